@@ -176,26 +176,50 @@ int32_t AbstractWebViewer::start()
 
   if (_config->shortTermCacheEnabled) {
     _cache.reset(new CacheContext(_config->shortTermCachePath.string(),
+                                  _config->shortTermCacheShards,
+                                  _config->shortTermCacheDecoderThreadsCound,
                                   _context,
                                   _config->shortTermCacheDebugLogsEnabled,
                                   _config->shortTermCachePrefetchOnInstanceStored,
+                                  _config->shortTermCachePrefetchOnStudyOpened,
                                   _seriesRepository.get())
                  );
     ::_cache = _cache.get();
+    _cache->SetInstancePrefetchBudget(_config->shortTermCachePrefetchOnInstanceStoredMaxFrames,
+                                      static_cast<uint64_t>(_config->shortTermCachePrefetchOnInstanceStoredMaxSize) * 1024 * 1024);
 
     OrthancPlugins::CacheScheduler& scheduler = _cache->GetScheduler();
-    scheduler.RegisterPolicy(new OrthancPlugins::ViewerPrefetchPolicy(_context, _seriesRepository.get()));
+    OrthancPlugins::ViewerPrefetchPolicy* policy = new OrthancPlugins::ViewerPrefetchPolicy(_context, _seriesRepository.get());
+    policy->SetWindow(_config->shortTermCachePrefetchMinForward,
+                      _config->shortTermCachePrefetchMaxForward,
+                      _config->shortTermCachePrefetchBackward);
+    scheduler.RegisterPolicy(policy);
     scheduler.Register(CacheBundle_SeriesInformation,
-                       new OrthancPlugins::SeriesInformationAdapter(_context, scheduler), 1);
+                       new OrthancPlugins::SeriesInformationAdapter(_context, scheduler), 1 /* weight */);
     /* Set the quotas */
     scheduler.SetQuota(CacheBundle_SeriesInformation, 1000, 0);    // Keep info about 1000 series
+    scheduler.SetMemoryQuota(CacheBundle_SeriesInformation, 16 * 1024 * 1024);
 
     scheduler.Register(CacheBundle_DecodedImage,
-                       new ImageControllerCacheFactory(_imageRepository.get()),
-                       _config->shortTermCacheDecoderThreadsCound);
-    scheduler.SetQuota(CacheBundle_DecodedImage, 0, static_cast<uint64_t>(_config->shortTermCacheSize) * 1024 * 1024);
+                       new ImageControllerCacheFactory(_imageRepository.get()), 4 /* weight */);
+    // The decoded images are evicted according to their creation cost: a
+    // lossless image of a large frame is kept longer than a small JPEG
+    scheduler.SetQuota(CacheBundle_DecodedImage, 0, static_cast<uint64_t>(_config->shortTermCacheSize) * 1024 * 1024,
+                       OrthancPlugins::CacheEvictionPolicy_GreedyDualSizeFrequency);
+    scheduler.SetMemoryQuota(CacheBundle_DecodedImage, static_cast<uint64_t>(_config->shortTermCacheMemorySize) * 1024 * 1024);
+    scheduler.SetSegmentStorageEnabled(CacheBundle_DecodedImage, _config->shortTermCacheSegmentStorageEnabled);
+
+    scheduler.SetPrefetchThrottling(_config->shortTermCachePrefetchPauseThreshold,
+                                    _config->shortTermCachePrefetchRate,
+                                    _config->shortTermCachePrefetchBurst);
+
+    if (_config->shortTermCacheRewarmEnabled)
+    {
+      scheduler.StartRewarm();
+    }
 
     ImageController::Inject(_cache.get());
+    StudyController::Inject(_cache.get());
   }
 
   _instanceRepository->EnableCachingInMetadata(_config->instanceInfoCacheEnabled);
@@ -215,6 +239,7 @@ int32_t AbstractWebViewer::start()
 
   // Inject configuration within components
   _imageRepository->enableCachedImageStorage(_config->persistentCachedImageStorageEnabled);
+  _imageRepository->setMemoryBudget(static_cast<uint64_t>(_config->decodingMemoryBudget) * 1024 * 1024);
   _annotationRepository->enableAnnotationStorage(_config->annotationStorageEnabled);
 
   // Configure DICOM decoder policy (GDCM/internal)
@@ -258,6 +283,12 @@ namespace
         ::_instanceRepository->SignalNewInstance(resourceId);
         ::_cache->SignalNewInstance(resourceId);
       }
+      else if (changeType == OrthancPluginChangeType_Deleted &&
+               resourceType == OrthancPluginResourceType_Series)
+      {
+        // The prefetches are grouped by series
+        ::_cache->GetScheduler().CancelPrefetch(resourceId);
+      }
 
       return OrthancPluginErrorCode_Success;
     }
@@ -254,11 +254,25 @@ void WebViewerConfiguration::_parseFile(const Json::Value& wvConfig)
   openAllPatientStudies = OrthancPlugins::GetBoolValue(wvConfig, "OpenAllPatientStudies", true);
   showStudyInformationBreadcrumb = OrthancPlugins::GetBoolValue(wvConfig, "ShowStudyInformationBreadcrumb", false);
   shortTermCachePrefetchOnInstanceStored = OrthancPlugins::GetBoolValue(wvConfig, "ShortTermCachePrefetchOnInstanceStored", false);
+  shortTermCachePrefetchOnInstanceStoredMaxFrames = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCachePrefetchOnInstanceStoredMaxFrames", 1000), 0);
+  shortTermCachePrefetchOnInstanceStoredMaxSize = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCachePrefetchOnInstanceStoredMaxSize", 512), 0);
+  shortTermCachePrefetchOnStudyOpened = OrthancPlugins::GetBoolValue(wvConfig, "ShortTermCachePrefetchOnStudyOpened", false);
   shortTermCacheEnabled = OrthancPlugins::GetBoolValue(wvConfig, "ShortTermCacheEnabled", false);
   shortTermCacheDebugLogsEnabled = OrthancPlugins::GetBoolValue(wvConfig, "ShortTermCacheDebugLogsEnabled", false);
   shortTermCachePath = OrthancPlugins::GetStringValue(wvConfig, "ShortTermCachePath", shortTermCachePath.string());
   shortTermCacheSize = OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCacheSize", 1000);
+  shortTermCacheMemorySize = OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCacheMemorySize", 256);
+  shortTermCacheShards = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCacheShards", 1), 1);
+  shortTermCacheSegmentStorageEnabled = OrthancPlugins::GetBoolValue(wvConfig, "ShortTermCacheSegmentStorage", false);
+  shortTermCacheRewarmEnabled = OrthancPlugins::GetBoolValue(wvConfig, "ShortTermCacheRewarm", false);
+  shortTermCachePrefetchPauseThreshold = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCachePrefetchPauseThreshold", 2), 0);
+  shortTermCachePrefetchRate = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCachePrefetchRate", 0), 0);
+  shortTermCachePrefetchBurst = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCachePrefetchBurst", 10), 1);
+  shortTermCachePrefetchMinForward = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCachePrefetchMinForward", 10), 1);
+  shortTermCachePrefetchMaxForward = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCachePrefetchMaxForward", 100), shortTermCachePrefetchMinForward);
+  shortTermCachePrefetchBackward = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "ShortTermCachePrefetchBackward", 3), 0);
   shortTermCacheDecoderThreadsCound = OrthancPlugins::GetIntegerValue(wvConfig, "Threads", std::max(boost::thread::hardware_concurrency() / 2, 1u));
+  decodingMemoryBudget = std::max(OrthancPlugins::GetIntegerValue(wvConfig, "DecodingMemoryBudget", 1024), 0);
   highQualityImagePreloadingEnabled = OrthancPlugins::GetBoolValue(wvConfig, "HighQualityImagePreloadingEnabled", true);
   reduceTimelineHeightOnSingleFrameSeries = OrthancPlugins::GetBoolValue(wvConfig, "ReduceTimelineHeightOnSingleFrameSeries", false);
   showNoReportIconInSeriesList = OrthancPlugins::GetBoolValue(wvConfig, "ShowNoReportIconInSeriesList", false);
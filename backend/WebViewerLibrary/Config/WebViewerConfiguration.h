@@ -45,9 +45,24 @@ public:
   bool shortTermCacheEnabled;
   bool shortTermCacheDebugLogsEnabled;
   bool shortTermCachePrefetchOnInstanceStored;
+  int shortTermCachePrefetchOnInstanceStoredMaxFrames;
+  int shortTermCachePrefetchOnInstanceStoredMaxSize;
+  bool shortTermCachePrefetchOnStudyOpened;
   boost::filesystem::path shortTermCachePath;
   int shortTermCacheDecoderThreadsCound;
   int shortTermCacheSize;
+  int shortTermCacheMemorySize;
+  int shortTermCacheShards;
+  bool shortTermCacheSegmentStorageEnabled;
+  bool shortTermCacheRewarmEnabled;
+  int shortTermCachePrefetchPauseThreshold;
+  int shortTermCachePrefetchRate;
+  int shortTermCachePrefetchBurst;
+  int shortTermCachePrefetchMinForward;
+  int shortTermCachePrefetchMaxForward;
+  int shortTermCachePrefetchBackward;
+
+  int decodingMemoryBudget;
 
   bool instanceInfoCacheEnabled;
 
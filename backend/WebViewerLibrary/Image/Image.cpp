@@ -1,5 +1,8 @@
 #include "Image.h"
 
+#include <Core/Images/ImageProcessing.h> // for Copy
+#include <Core/OrthancException.h> // for throws
+
 Image::Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<RawImageContainer> data, const Json::Value& dicomTags)
   : metaData_(data.get(), dicomTags), data_(data)
 {
@@ -16,6 +19,15 @@ Image::Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<I
   assert(data_.get() != NULL);
 }
 
+Image::Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<RawImageContainer> data, const ImageMetaData& metaData)
+  : metaData_(), data_(data)
+{
+  metaData_.Assign(metaData);
+  instanceId_ = instanceId;
+  frameIndex_ = frameIndex;
+  assert(data_.get() != NULL);
+}
+
 Image::Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<CornerstoneKLVContainer> data)
   : metaData_(), data_(data)
 {
@@ -37,3 +49,21 @@ void Image::ApplyProcessing(IImageProcessingPolicy* policy)
 
   data_ = output;
 }
+
+std::auto_ptr<Image> Image::CloneRaw() const
+{
+  RawImageContainer* raw = dynamic_cast<RawImageContainer*>(data_.get());
+  if (raw == NULL) {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  const Orthanc::ImageAccessor& source = *raw->GetOrthancImageAccessor();
+
+  Orthanc::ImageBuffer* buffer = new Orthanc::ImageBuffer(source.GetFormat(), source.GetWidth(), source.GetHeight(), false);
+  std::auto_ptr<RawImageContainer> data(new RawImageContainer(buffer)); // takes buffer memory ownership
+
+  Orthanc::ImageProcessing::Copy(*data->GetOrthancImageAccessor(), source);
+
+  std::auto_ptr<Image> image(new Image(instanceId_, frameIndex_, data, metaData_));
+  return image;
+}
@@ -43,6 +43,11 @@ private:
   // recompress it).
   Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<IImageContainer> data, const Orthanc::DicomMap& headerTags, const Json::Value& dicomTags);
 
+  // takes memory ownership
+  // This constructor is called when a decoded image is copied, so that
+  // another policy can be applied to it (see CloneRaw).
+  Image(const std::string& instanceId, uint32_t frameIndex, std::auto_ptr<RawImageContainer> data, const ImageMetaData& metaData);
+
   // takes memory ownership
   // This constructor is called when the image object is created from a cached
   // klv image (available in attachment).
@@ -50,6 +55,10 @@ private:
 
   void ApplyProcessing(IImageProcessingPolicy* policy);
 
+  // Deep copy of an image that has not been processed yet (i.e. whose
+  // data is still raw), along with its metadata
+  std::auto_ptr<Image> CloneRaw() const;
+
 private:
   std::string instanceId_;
   uint32_t frameIndex_;
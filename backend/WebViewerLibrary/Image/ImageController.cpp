@@ -217,12 +217,12 @@ int ImageController::_ProcessRequest()
 
       if (cacheContext_ != NULL)  //if there is a cache enabled
       {
-        std::string content;
+        OrthancPlugins::MemoryCache::Content content;
         if (cacheContext_->GetScheduler().Access(content, CacheBundle_DecodedImage, this->urlPostfix_))
         {
           BENCH(REQUEST_ANSWERING);
 
-          return this->_AnswerBuffer(content.c_str(), content.size(), "application/octet-stream");
+          return this->_AnswerBuffer(content->GetData(), content->GetSize(), "application/octet-stream");
         }
         else
         {
@@ -376,6 +376,73 @@ bool ImageControllerCacheFactory::Create(std::string& content,
   return true;
 }
 
+std::string ImageControllerCacheFactory::GetBatchPrefix(const std::string& uri)
+{
+  // The policy might contain slashes as well (composite policies), the
+  // prefix ends at the second one
+  size_t instanceEnd = uri.find('/');
+  if (instanceEnd == std::string::npos) {
+    return "";
+  }
+
+  size_t frameEnd = uri.find('/', instanceEnd + 1);
+  if (frameEnd == std::string::npos) {
+    return "";
+  }
+
+  return uri.substr(0, frameEnd + 1);
+}
+
+bool ImageControllerCacheFactory::CreateBatch(std::vector<std::string>& contents,
+                                              const std::vector<std::string>& uris)
+{
+  std::string instanceId;
+  uint32_t frameIndex = 0;
+  std::vector<IImageProcessingPolicy*> policies;
+  bool success = true;
+
+  policies.reserve(uris.size());
+
+  for (size_t i = 0; i < uris.size() && success; i++)
+  {
+    std::string uriInstanceId;
+    uint32_t uriFrameIndex;
+    std::auto_ptr<IImageProcessingPolicy> processingPolicy;
+
+    if (!ImageControllerUrlParser::parseUrlPostfix(uris[i], uriInstanceId, uriFrameIndex, processingPolicy) ||
+        (i > 0 && (uriInstanceId != instanceId || uriFrameIndex != frameIndex))) {
+      // Let the items be created one by one
+      success = false;
+    }
+    else {
+      instanceId = uriInstanceId;
+      frameIndex = uriFrameIndex;
+      policies.push_back(processingPolicy.release());
+    }
+  }
+
+  try
+  {
+    if (success) {
+      // retrieve all the processed images from a single decoding
+      imageRepository_->GetProcessedImages(contents, instanceId, frameIndex, policies);
+    }
+  }
+  catch (...)
+  {
+    BOOST_FOREACH(IImageProcessingPolicy* policy, policies) {
+      delete policy;
+    }
+    throw;
+  }
+
+  BOOST_FOREACH(IImageProcessingPolicy* policy, policies) {
+    delete policy;
+  }
+
+  return success;
+}
+
 void ImageControllerCacheFactory::Invalidate(const std::string& item)
 {
   this->imageRepository_->invalidateInstance(item);
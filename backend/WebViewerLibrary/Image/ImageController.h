@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "../BaseController.h"
 #include "../Annotation/AnnotationRepository.h"
@@ -69,6 +70,13 @@ public:
   virtual bool Create(std::string& content,
                       const std::string& uri);
 
+  // The qualities of the same frame share the prefix "{instance}/{frame}/"
+  virtual std::string GetBatchPrefix(const std::string& uri);
+
+  // Decodes the frame once for all the qualities
+  virtual bool CreateBatch(std::vector<std::string>& contents,
+                           const std::vector<std::string>& uris);
+
   virtual void Invalidate(const std::string& item);
 
 };
@@ -143,6 +143,17 @@ ImageMetaData::ImageMetaData(const DicomMap& headerTags, const Json::Value& dico
   BENCH_LOG(IMAGE_HEIGHT, height);
 }
 
+void ImageMetaData::Assign(const ImageMetaData& other)
+{
+  height = other.height;
+  width = other.width;
+  sizeInBytes = other.sizeInBytes;
+  stretched = other.stretched;
+  minPixelValue = other.minPixelValue;
+  maxPixelValue = other.maxPixelValue;
+  inverted = other.inverted;
+}
+
 namespace {
   float GetFloatTag(const Json::Value& dicomTags,
                            const std::string& tagName,
@@ -28,6 +28,11 @@ struct ImageMetaData : public boost::noncopyable {
   // recompress it).
   ImageMetaData(const Orthanc::DicomMap& headerTags, const Json::Value& dicomTags);
 
+  // Copies the attributes of another image, so that the min/max pixel
+  // values of a decoded frame are only computed once, even if several
+  // policies are applied to copies of this frame.
+  void Assign(const ImageMetaData& other);
+
   // The following attributes are attributes required to process the image in
   // the frontend that are not available from the dicom tags.
   
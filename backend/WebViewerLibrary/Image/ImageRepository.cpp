@@ -1,4 +1,5 @@
 #include <string>
+#include <algorithm> // for std::max
 #include <orthanc/OrthancCPlugin.h>
 #include <json/writer.h>
 #include <boost/lexical_cast.hpp>
@@ -7,6 +8,7 @@
 #include <Core/OrthancException.h> // for throws
 #include <Core/DicomFormat/DicomMap.h>
 #include <Core/Enumerations.h>
+#include <Core/Toolbox.h> // for StripSpaces
 #include "../ViewerToolbox.h" // for OrthancPlugins::get*FromOrthanc && OrthancPluginImage
 #include "../BenchmarkHelper.h" // for BENCH(*)
 #include "../OrthancContextManager.h" // for context_ global
@@ -22,6 +24,7 @@
 namespace
 {
   void _loadDicomTags(Json::Value& jsonOutput, const std::string& instanceId);
+  uint64_t _estimateDecodingMemory(const Json::Value& dicomTags, size_t policiesCount);
   std::string _getAttachmentNumber(int frameIndex, const IImageProcessingPolicy* policy);
   void ConvertRGB48ToRGB24(Orthanc::ImageAccessor& target,
                            const Orthanc::ImageAccessor& source)
@@ -50,7 +53,7 @@ namespace
 }
 
 ImageRepository::ImageRepository(DicomRepository* dicomRepository, CacheContext* cache)
-  : _dicomRepository(dicomRepository), _cachedImageStorageEnabled(true), _shortTermCacheContext(cache)
+  : _dicomRepository(dicomRepository), _cachedImageStorageEnabled(true), _shortTermCacheContext(cache), _memoryBudget(0)
 {
 }
 
@@ -59,7 +62,7 @@ std::auto_ptr<Image> ImageRepository::GetImage(const std::string& instanceId, ui
 {
   // Return uncached image
   if (!enableCache || !isCachedImageStorageEnabled()) {
-    return this->_LoadImageFromOrthanc(instanceId, frameIndex, policy);
+    return this->_LoadImageWithinBudget(instanceId, frameIndex, policy);
   }
   // Return cached image (& save in cache if uncached)
   else {
@@ -72,7 +75,7 @@ std::auto_ptr<Image> ImageRepository::GetImage(const std::string& instanceId, ui
     // Load & cache image if not found
     if (image.get() == 0) {
       // Load image
-      image = this->_LoadImageFromOrthanc(instanceId, frameIndex, policy);
+      image = this->_LoadImageWithinBudget(instanceId, frameIndex, policy);
 
       // Cache image
       this->_CacheProcessedImage(attachmentNumber, image.get());
@@ -84,6 +87,40 @@ std::auto_ptr<Image> ImageRepository::GetImage(const std::string& instanceId, ui
 
 }
 
+void ImageRepository::GetProcessedImages(std::vector<std::string>& binaries, const std::string& instanceId, uint32_t frameIndex, const std::vector<IImageProcessingPolicy*>& policies) const
+{
+  binaries.resize(policies.size());
+
+  Json::Value dicomTags;
+  _loadDicomTags(dicomTags, instanceId);
+
+  // The decoded frame is kept while all the policies are applied
+  MemoryBudget::Reservation reservation(_memoryBudget, _estimateDecodingMemory(dicomTags, policies.size()));
+
+  // Decoded frame, shared by the policies that need raw pixels
+  std::auto_ptr<Image> decoded;
+
+  for (size_t i = 0; i < policies.size(); i++)
+  {
+    std::auto_ptr<Image> image;
+
+    // The PixelData policy does not decode the frame
+    if (dynamic_cast<PixelDataQualityPolicy*>(policies[i]) != NULL) {
+      image = this->_LoadImageFromOrthanc(instanceId, frameIndex, policies[i], dicomTags);
+    }
+    else {
+      if (decoded.get() == NULL) {
+        decoded = this->_LoadImageFromOrthanc(instanceId, frameIndex, NULL, dicomTags);
+      }
+
+      image = decoded->CloneRaw();
+      image->ApplyProcessing(policies[i]);
+    }
+
+    binaries[i].assign(image->GetBinary(), image->GetBinarySize());
+  }
+}
+
 void ImageRepository::CleanImageCache(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy) const
 {
   // set cache url
@@ -105,15 +142,22 @@ void ImageRepository::invalidateInstance(const std::string& instanceId)
   _dicomRepository->invalidateDicomFile(instanceId);
 }
 
-std::auto_ptr<Image> ImageRepository::_LoadImageFromOrthanc(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy) const {
-  BENCH_LOG(IMAGE_FORMATING, "");
-
-  // boost::lock_guard<boost::mutex> guard(mutex_); // make sure the memory amount doesn't overrise
-
+std::auto_ptr<Image> ImageRepository::_LoadImageWithinBudget(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy) const {
   // Load dicom tags
   Json::Value dicomTags;
   _loadDicomTags(dicomTags, instanceId);
 
+  // Wait for the other decodings to release enough memory
+  MemoryBudget::Reservation reservation(_memoryBudget, _estimateDecodingMemory(dicomTags, 1));
+
+  return this->_LoadImageFromOrthanc(instanceId, frameIndex, policy, dicomTags);
+}
+
+std::auto_ptr<Image> ImageRepository::_LoadImageFromOrthanc(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy, const Json::Value& dicomTags) const {
+  BENCH_LOG(IMAGE_FORMATING, "");
+
+  // boost::lock_guard<boost::mutex> guard(mutex_); // make sure the memory amount doesn't overrise
+
   // Load frame - Either directly from orthanc (without decompression/recompression; when PixelData route is called),
   // or with a compression done by the plugin (when Policy is not PixelData; slower)
   std::auto_ptr<Image> image;
@@ -310,6 +354,34 @@ namespace
     }
   }
 
+  uint32_t _getIntegerTag(const Json::Value& dicomTags, const std::string& tagName, uint32_t defaultValue)
+  {
+    if (dicomTags.isMember(tagName) && dicomTags[tagName].isString()) {
+      try {
+        return boost::lexical_cast<uint32_t>(Orthanc::Toolbox::StripSpaces(dicomTags[tagName].asString()));
+      }
+      catch (boost::bad_lexical_cast&) {
+      }
+    }
+
+    return defaultValue;
+  }
+
+  uint64_t _estimateDecodingMemory(const Json::Value& dicomTags, size_t policiesCount)
+  {
+    // Same estimate of the size of a frame as in ImageMetaData
+    uint64_t frameSize = static_cast<uint64_t>(_getIntegerTag(dicomTags, "Columns", 0)) *
+                         _getIntegerTag(dicomTags, "Rows", 0) *
+                         _getIntegerTag(dicomTags, "SamplesPerPixel", 1) *
+                         ((_getIntegerTag(dicomTags, "BitsAllocated", 16) + 7) / 8);
+    uint64_t framesCount = std::max(_getIntegerTag(dicomTags, "NumberOfFrames", 1), 1u);
+
+    // The whole DICOM file is loaded (at most all its frames uncompressed),
+    // the frame is decoded, then each policy works on its own copy of the
+    // frame and produces an intermediate and an encoded image
+    return frameSize * (framesCount + 1 + 2 * policiesCount);
+  }
+
   std::string _getAttachmentNumber(int frameIndex, const IImageProcessingPolicy* policy)
   {
     assert(policy != NULL);
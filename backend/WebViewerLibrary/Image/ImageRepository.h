@@ -2,11 +2,13 @@
 #define IMAGE_REPOSITORY_H
 
 #include <string>
+#include <vector>
 #include <boost/thread/mutex.hpp>
 #include <orthanc/OrthancCPlugin.h>
 
 #include "../Instance/DicomRepository.h"
 #include "Image.h"
+#include "Utilities/MemoryBudget.h"
 
 class CacheContext;
 
@@ -25,11 +27,17 @@ public:
 
   // gives memory ownership
   std::auto_ptr<Image> GetImage(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy, bool enableCache) const;
+  // Decodes the frame once, and applies each policy to its own copy of
+  // the decoded frame. "binaries" receives the processed images, in the
+  // order of the policies.
+  void GetProcessedImages(std::vector<std::string>& binaries, const std::string& instanceId, uint32_t frameIndex, const std::vector<IImageProcessingPolicy*>& policies) const;
   void CleanImageCache(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy) const;
 
   void invalidateInstance(const std::string& instanceId);
   void enableCachedImageStorage(bool enable) {_cachedImageStorageEnabled = enable;}
   bool isCachedImageStorageEnabled() const {return _cachedImageStorageEnabled;}
+  // Bounds the memory used by the frames being decoded (0 for no limit)
+  void setMemoryBudget(uint64_t maxBytes) {_memoryBudget.SetMaxBytes(maxBytes);}
 
 private:
    // _imageLoadingPolicy;
@@ -38,8 +46,10 @@ private:
   CacheContext* _shortTermCacheContext;
   bool _cachedImageStorageEnabled;
   mutable boost::mutex mutex_;
+  mutable MemoryBudget _memoryBudget;
 
-  std::auto_ptr<Image> _LoadImageFromOrthanc(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy) const; // Factory method
+  std::auto_ptr<Image> _LoadImageWithinBudget(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy) const;
+  std::auto_ptr<Image> _LoadImageFromOrthanc(const std::string& instanceId, uint32_t frameIndex, IImageProcessingPolicy* policy, const Json::Value& dicomTags) const; // Factory method
   void _CacheProcessedImage(const std::string &attachmentNumber, const Image* image) const;
   std::auto_ptr<Image> _GetProcessedImageFromCache(const std::string &attachmentNumber, const std::string& instanceId, uint32_t frameIndex) const; // Return 0 when no cache found
 };
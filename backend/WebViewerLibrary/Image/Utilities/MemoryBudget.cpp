@@ -0,0 +1,61 @@
+#include "MemoryBudget.h"
+#include <assert.h>
+
+MemoryBudget::MemoryBudget(uint64_t maxBytes)
+  : maxBytes_(maxBytes), reserved_(0), nextTicket_(0), currentTicket_(0)
+{
+}
+
+void MemoryBudget::SetMaxBytes(uint64_t maxBytes)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  maxBytes_ = maxBytes;
+  changed_.notify_all();
+}
+
+uint64_t MemoryBudget::GetReservedBytes() const
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return reserved_;
+}
+
+void MemoryBudget::Reserve(uint64_t bytes)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // First come, first served: a large reservation is not overtaken by
+  // the smaller ones that keep fitting in the budget
+  const uint64_t ticket = nextTicket_++;
+
+  while (ticket != currentTicket_ ||
+         (maxBytes_ != 0 &&
+          reserved_ != 0 &&
+          reserved_ + bytes > maxBytes_))
+  {
+    changed_.wait(lock);
+  }
+
+  reserved_ += bytes;
+  currentTicket_++;
+  changed_.notify_all();
+}
+
+void MemoryBudget::Release(uint64_t bytes)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  assert(reserved_ >= bytes);
+  reserved_ -= bytes;
+  changed_.notify_all();
+}
+
+MemoryBudget::Reservation::Reservation(MemoryBudget& budget, uint64_t bytes)
+  : budget_(budget), bytes_(bytes)
+{
+  budget_.Reserve(bytes_);
+}
+
+MemoryBudget::Reservation::~Reservation()
+{
+  budget_.Release(bytes_);
+}
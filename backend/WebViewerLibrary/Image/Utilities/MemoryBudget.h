@@ -0,0 +1,50 @@
+#pragma once
+
+#include <boost/cstdint.hpp> // for uint64_t
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/** MemoryBudget
+ *
+ * Bounds the memory used by the frames that are decoded and encoded at
+ * the same time. Each decoding reserves its estimated footprint before
+ * it starts, and the reservations that would exceed the budget wait in
+ * their order of arrival instead of allocating. A reservation larger
+ * than the whole budget is granted once nothing else is reserved, so
+ * that a huge image is decoded alone instead of failing.
+ *
+ */
+class MemoryBudget : public boost::noncopyable
+{
+public:
+  // 0 for no limit
+  explicit MemoryBudget(uint64_t maxBytes);
+
+  void SetMaxBytes(uint64_t maxBytes);
+
+  uint64_t GetReservedBytes() const;
+
+  // Blocks until the bytes can be reserved, releases them at destruction
+  class Reservation : public boost::noncopyable
+  {
+  public:
+    Reservation(MemoryBudget& budget, uint64_t bytes);
+    ~Reservation();
+
+  private:
+    MemoryBudget& budget_;
+    uint64_t bytes_;
+  };
+
+private:
+  mutable boost::mutex mutex_;
+  boost::condition_variable changed_;
+  uint64_t maxBytes_;
+  uint64_t reserved_;
+  uint64_t nextTicket_;     // Given to the next reservation
+  uint64_t currentTicket_;  // Reservation that is the next to be granted
+
+  void Reserve(uint64_t bytes);
+  void Release(uint64_t bytes);
+};
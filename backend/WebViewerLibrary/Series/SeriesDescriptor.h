@@ -0,0 +1,30 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "../Image/AvailableQuality/ImageQuality.h"
+
+/** SeriesDescriptor [@ValueObject]
+ *
+ * Lightweight description of a series, that is enough for the prefetch
+ *   decisions. It is built from the metadata and the simplified tags of
+ *   a single instance, without loading any DICOM file.
+ *
+ */
+struct SeriesDescriptor {
+  std::string transferSyntax;
+  std::string contentType;
+  uint32_t columns;
+  uint32_t rows;
+  std::set<ImageQuality::EImageQuality> imageQualities;
+
+  SeriesDescriptor() : columns(0), rows(0) {}
+
+  // Same order as `Series::GetOrderedImageQualities`: the set is sorted by
+  // increasing quality
+  std::vector<ImageQuality::EImageQuality> GetOrderedImageQualities(ImageQuality::EImageQuality higherThan = ImageQuality::NONE) const {
+    return std::vector<ImageQuality::EImageQuality>(imageQualities.upper_bound(higherThan), imageQualities.end());
+  }
+};
@@ -24,10 +24,23 @@ std::auto_ptr<Series> SeriesFactory::CreateSeries(const std::string& seriesId,
   std::string contentType;
   std::set<ImageQuality::EImageQuality> imageQualities;
 
+  GetContentDescription(contentType, imageQualities, middleInstanceMetaInfoTags["TransferSyntax"].asString(), middleInstanceInfos);
+
+  // Create the series
+  return std::auto_ptr<Series>(new Series(seriesId, contentType, middleInstanceInfos, instancesInfos, slicesShort, imageQualities, studyInfo));
+}
+
+void SeriesFactory::GetContentDescription(std::string& contentType,
+                                          std::set<ImageQuality::EImageQuality>& imageQualities,
+                                          const std::string& transferSyntax,
+                                          const Json::Value& middleInstanceInfos)
+{
+  contentType.clear();
+  imageQualities.clear();
+
   // Check the middle instance's type (`[multiframe] image / pdf / image`
   // instance.
   Json::Value mimeType = middleInstanceInfos["TagsSubset"]["MIMETypeOfEncapsulatedDocument"];
-  std::string transferSyntax = middleInstanceMetaInfoTags["TransferSyntax"].asString();
 
   // If the middle instance is a `pdf` instance, set `pdf` type & keep 
   // available qualities empty.
@@ -62,9 +75,6 @@ std::auto_ptr<Series> SeriesFactory::CreateSeries(const std::string& seriesId,
     // Retrieve available image formats. This may throw if dicom instance is
     // in fact not related to image. Therefore, we rely on this exception to 
     // deliver HTTP 500 error on unsupported format.
-    imageQualities = _availableQualityPolicy->retrieve(middleInstanceMetaInfoTags["TransferSyntax"].asString(), middleInstanceInfos["TagsSubset"]);
+    imageQualities = _availableQualityPolicy->retrieve(transferSyntax, middleInstanceInfos["TagsSubset"]);
   }
-  
-  // Create the series
-  return std::auto_ptr<Series>(new Series(seriesId, contentType, middleInstanceInfos, instancesInfos, slicesShort, imageQualities, studyInfo));
 }
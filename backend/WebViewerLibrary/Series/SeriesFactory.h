@@ -16,6 +16,13 @@ public:
                                      const Json::Value& instancesInfos,
                                      const Json::Value& studyInfo);
 
+  // Content type (`image`, `pdf`, `video/...`) and available qualities of a
+  // series, based on its middle instance
+  void GetContentDescription(std::string& contentType,
+                             std::set<ImageQuality::EImageQuality>& imageQualities,
+                             const std::string& transferSyntax,
+                             const Json::Value& middleInstanceInfos);
+
 
 private:
   const std::auto_ptr<IAvailableQualityPolicy> _availableQualityPolicy;
@@ -3,6 +3,7 @@
 #include <memory>
 #include <string>
 #include <json/value.h>
+#include <boost/lexical_cast.hpp>
 #include <Core/OrthancException.h>
 #include <Core/DicomFormat/DicomMap.h> // To retrieve transfer syntax
 #include <Core/Toolbox.h> // For _getTransferSyntax -> Orthanc::Toolbox::StripSpaces
@@ -18,6 +19,9 @@
 std::string seriesMetadataId = "9997";
 int seriesInfoJsonVersion = 2; // 1 -> 2: Added PatientSex in instances
 
+// The descriptors are small, but a server may host many series
+static const size_t MAX_CACHED_DESCRIPTORS = 1000;
+
 
 namespace {
   std::string _getTransferSyntax(const Orthanc::DicomMap& headerTags);
@@ -113,27 +117,9 @@ std::auto_ptr<Series> SeriesRepository::GenerateSeriesInfo(const std::string& se
     instancesInfos[middleInstanceId] = _instanceRepository->GetInstanceInfo(middleInstanceId);
   }
 
-  // Get middle instance's dicom file
-  OrthancPluginMemoryBuffer dicom; // no need to free - memory managed by dicomRepository
-  _dicomRepository->getDicomFile(middleInstanceId, dicom);
-
-  // Clean middle instance's dicom file (at scope end)
-  DicomRepository::ScopedDecref autoDecref(_dicomRepository, middleInstanceId);
-
   // Get middle instance's tags (the DICOM meta-informations)
-  Orthanc::DicomMap dicomMapToFillTags1;
   Json::Value tags1;
-  if (!Orthanc::DicomMap::ParseDicomMetaInformation(dicomMapToFillTags1, reinterpret_cast<const char*>(dicom.data), dicom.size))
-  {
-    // Consider implicit VR if `ParseDicomMetaInformation` has failed (it fails
-    // because `DICM` header at [128..131] is not present in the DICOM instance  
-    // binary file). In our tests, while being visible in some other viewers,
-    // those files didn't have any TransferSyntax either.
-    tags1["TransferSyntax"] = "1.2.840.10008.1.2";
-  }
-  else {
-    tags1["TransferSyntax"] = _getTransferSyntax(dicomMapToFillTags1);
-  }
+  tags1["TransferSyntax"] = GetTransferSyntaxFromDicomFile(middleInstanceId);
 
   // Get middle instance's tags (the other tags)
   const Json::Value& middleInstanceInfos = instancesInfos[middleInstanceId];
@@ -159,6 +145,102 @@ std::auto_ptr<Series> SeriesRepository::GenerateSeriesInfo(const std::string& se
   return std::auto_ptr<Series>(_seriesFactory.CreateSeries(seriesId, sortedSlicesShort, tags1, middleInstanceInfos, instancesInfos, studyInfo));
 }
 
+std::string SeriesRepository::GetTransferSyntaxFromDicomFile(const std::string& instanceId)
+{
+  // Get the instance's dicom file
+  OrthancPluginMemoryBuffer dicom; // no need to free - memory managed by dicomRepository
+  _dicomRepository->getDicomFile(instanceId, dicom);
+
+  // Clean the instance's dicom file (at scope end)
+  DicomRepository::ScopedDecref autoDecref(_dicomRepository, instanceId);
+
+  // Get the instance's tags (the DICOM meta-informations)
+  Orthanc::DicomMap dicomMapToFillTags;
+  if (!Orthanc::DicomMap::ParseDicomMetaInformation(dicomMapToFillTags, reinterpret_cast<const char*>(dicom.data), dicom.size))
+  {
+    // Consider implicit VR if `ParseDicomMetaInformation` has failed (it fails
+    // because `DICM` header at [128..131] is not present in the DICOM instance  
+    // binary file). In our tests, while being visible in some other viewers,
+    // those files didn't have any TransferSyntax either.
+    return "1.2.840.10008.1.2";
+  }
+  else {
+    return _getTransferSyntax(dicomMapToFillTags);
+  }
+}
+
+SeriesDescriptor SeriesRepository::GetSeriesDescriptor(const std::string& seriesId)
+{
+  {
+    boost::mutex::scoped_lock lock(_descriptorsMutex);
+
+    std::map<std::string, SeriesDescriptor>::const_iterator found = _descriptors.find(seriesId);
+    if (found != _descriptors.end()) {
+      return found->second;
+    }
+  }
+
+  // Built without the lock: two threads may build the same descriptor
+  SeriesDescriptor descriptor = GenerateSeriesDescriptor(seriesId);
+
+  {
+    boost::mutex::scoped_lock lock(_descriptorsMutex);
+
+    if (_descriptors.size() >= MAX_CACHED_DESCRIPTORS) {
+      _descriptors.erase(_descriptors.begin());
+    }
+
+    _descriptors[seriesId] = descriptor;
+  }
+
+  return descriptor;
+}
+
+void SeriesRepository::InvalidateSeriesDescriptor(const std::string& seriesId)
+{
+  boost::mutex::scoped_lock lock(_descriptorsMutex);
+  _descriptors.erase(seriesId);
+}
+
+SeriesDescriptor SeriesRepository::GenerateSeriesDescriptor(const std::string& seriesId)
+{
+  Json::Value seriesInfo;
+  if (!OrthancPlugins::GetJsonFromOrthanc(seriesInfo, _context, "/series/" + seriesId) ||
+      !seriesInfo.isMember("Instances") ||
+      seriesInfo["Instances"].size() == 0)
+  {
+    throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(OrthancPluginErrorCode_InexistentItem));
+  }
+
+  // Unlike `GenerateSeriesInfo`, the instances are not sorted: all the
+  // instances of a series are expected to share the same image format
+  const Json::Value& instances = seriesInfo["Instances"];
+  std::string middleInstanceId = instances[instances.size() / 2].asString();
+
+  // These tags are cached in the metadata of the instance, when enabled
+  Json::Value middleInstanceInfos = _instanceRepository->GetInstanceInfo(middleInstanceId);
+
+  SeriesDescriptor descriptor;
+
+  if (middleInstanceInfos["TransferSyntax"].isString()) {
+    descriptor.transferSyntax = middleInstanceInfos["TransferSyntax"].asString();
+  }
+  else {
+    // Old versions of Orthanc do not store the transfer syntax in metadata
+    descriptor.transferSyntax = GetTransferSyntaxFromDicomFile(middleInstanceId);
+  }
+
+  const Json::Value& tags = middleInstanceInfos["TagsSubset"];
+  if (tags.isMember("Columns") && tags.isMember("Rows")) {
+    descriptor.columns = boost::lexical_cast<uint32_t>(OrthancPlugins::SanitizeTag("Columns", tags["Columns"]).asString());
+    descriptor.rows = boost::lexical_cast<uint32_t>(OrthancPlugins::SanitizeTag("Rows", tags["Rows"]).asString());
+  }
+
+  _seriesFactory.GetContentDescription(descriptor.contentType, descriptor.imageQualities, descriptor.transferSyntax, middleInstanceInfos);
+
+  return descriptor;
+}
+
 namespace {
   std::string _getTransferSyntax(const Orthanc::DicomMap& headerTags)
   {
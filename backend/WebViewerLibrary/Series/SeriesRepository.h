@@ -1,9 +1,12 @@
 #pragma once
 
+#include <map>
 #include <memory>
+#include <boost/thread/mutex.hpp>
 #include "../Instance/DicomRepository.h"
 #include <orthanc/OrthancCPlugin.h>
 #include "Series.h"
+#include "SeriesDescriptor.h"
 #include "SeriesFactory.h"
 
 class InstanceRepository;
@@ -23,6 +26,9 @@ class SeriesRepository : public boost::noncopyable {
   SeriesFactory _seriesFactory;
   bool _cachingInMetadataEnabled;
 
+  boost::mutex _descriptorsMutex;
+  std::map<std::string, SeriesDescriptor> _descriptors;
+
 public:
   SeriesRepository(OrthancPluginContext* _context, DicomRepository* dicomRepository, InstanceRepository* instanceRepository);
 
@@ -30,9 +36,19 @@ public:
   std::auto_ptr<Series> GetSeries(const std::string& seriesId, bool getInstanceTags = true);
   void EnableCachingInMetadata(bool enable);
 
+  // Cached in memory, and cheap to build (no DICOM file is loaded): to be
+  // used when only the available qualities are needed, e.g. to prefetch.
+  // Thread-safe.
+  // @throws Orthanc::OrthancException(OrthancPluginErrorCode_InexistentItem)
+  SeriesDescriptor GetSeriesDescriptor(const std::string& seriesId);
+  // To be called when an instance of the series is received
+  void InvalidateSeriesDescriptor(const std::string& seriesId);
+
 private:
 
   std::auto_ptr<Series> GenerateSeriesInfo(const std::string& seriesId, bool getInstanceTags);
+  SeriesDescriptor GenerateSeriesDescriptor(const std::string& seriesId);
+  std::string GetTransferSyntaxFromDicomFile(const std::string& instanceId);
   void StoreSeriesInfoInMetadata(const std::string& seriesId, const Series& series);
 
 };
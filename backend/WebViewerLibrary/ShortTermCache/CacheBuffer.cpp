@@ -0,0 +1,36 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "CacheBuffer.h"
+
+
+namespace OrthancPlugins
+{
+  MappedCacheBuffer::MappedCacheBuffer(CacheReaper::Pin* pin,
+                                       const std::string& path,
+                                       uint64_t offset,
+                                       size_t size) :
+    pin_(pin),
+    mapping_(path.c_str(), boost::interprocess::read_only),
+    region_(mapping_, boost::interprocess::read_only, static_cast<boost::interprocess::offset_t>(offset), size)
+  {
+  }
+}
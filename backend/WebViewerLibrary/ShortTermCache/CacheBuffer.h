@@ -0,0 +1,108 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "CacheReaper.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <stdint.h>
+
+namespace OrthancPlugins
+{
+  // Read-only content of a cached item
+  class ICacheBuffer : public boost::noncopyable
+  {
+  public:
+    virtual ~ICacheBuffer()
+    {
+    }
+
+    virtual const char* GetData() const = 0;
+
+    virtual size_t GetSize() const = 0;
+  };
+
+
+  class StringCacheBuffer : public ICacheBuffer
+  {
+  private:
+    std::string  content_;
+
+  public:
+    // Takes the content of the string, which is left empty
+    explicit StringCacheBuffer(std::string& content)
+    {
+      content_.swap(content);
+    }
+
+    virtual const char* GetData() const
+    {
+      return content_.empty() ? NULL : content_.c_str();
+    }
+
+    virtual size_t GetSize() const
+    {
+      return content_.size();
+    }
+
+    const std::string& GetContent() const
+    {
+      return content_;
+    }
+  };
+
+
+  // View on a range of a file of the cache, that is mapped in memory
+  // instead of being read. The file is pinned, so that the CacheReaper
+  // does not remove it before the view is released.
+  class MappedCacheBuffer : public ICacheBuffer
+  {
+  private:
+    std::auto_ptr<CacheReaper::Pin>     pin_;   // Declared first, as it must be released last
+    boost::interprocess::file_mapping   mapping_;
+    boost::interprocess::mapped_region  region_;
+
+  public:
+    MappedCacheBuffer(CacheReaper::Pin* pin /* takes ownership */,
+                      const std::string& path,
+                      uint64_t offset,
+                      size_t size);
+
+    virtual const char* GetData() const
+    {
+      return reinterpret_cast<const char*>(region_.get_address());
+    }
+
+    virtual size_t GetSize() const
+    {
+      return region_.get_size();
+    }
+  };
+
+
+  typedef boost::shared_ptr<const ICacheBuffer>  CacheBufferPtr;
+}
@@ -1,29 +1,39 @@
 #include "CacheContext.h"
 #include "Series/SeriesRepository.h"
+#include "SeriesSliceIndex.h"
 #include <Core/OrthancException.h>
-#include <boost/foreach.hpp>
+#include <Core/Toolbox.h>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
 
 CacheContext::CacheContext(const std::string& path,
+                           size_t shardsCount,
+                           size_t threadsCount,
                            OrthancPluginContext* pluginContext,
                            bool debugLogsEnabled,
                            bool prefetchOnInstanceStored,
+                           bool prefetchOnStudyOpened,
                            SeriesRepository* seriesRepository)
   : pluginContext_(pluginContext),
-    storage_(path),
     seriesRepository_(seriesRepository),
     stop_(false),
-    prefetchOnInstanceStored_(prefetchOnInstanceStored)
+    prefetchOnInstanceStored_(prefetchOnInstanceStored),
+    instancePrefetchMaxFrames_(0),
+    instancePrefetchMaxBytes_(0),
+    prefetchOnStudyOpened_(prefetchOnStudyOpened)
 {
-  boost::filesystem::path p(path);
-  db_.Open((p / "cache.db").string());
-
   logger_.reset(new CacheLogger(pluginContext_, debugLogsEnabled));
-  cacheManager_.reset(new OrthancPlugins::CacheManager(pluginContext_, db_, storage_));
+  cacheManager_.reset(new OrthancPlugins::ShardedCacheManager(pluginContext_, path, shardsCount));
   //cache_->SetSanityCheckEnabled(true);  // For debug
 
-  scheduler_.reset(new OrthancPlugins::CacheScheduler(*cacheManager_, logger_.get(), 1000));
+  scheduler_.reset(new OrthancPlugins::CacheScheduler(*cacheManager_, logger_.get(), 1000, threadsCount));
 
   newInstancesThread_ = boost::thread(NewInstancesThread, this);
+
+  if (prefetchOnStudyOpened_)
+  {
+    openedStudiesThread_ = boost::thread(OpenedStudiesThread, this);
+  }
 }
 
 CacheContext::~CacheContext()
@@ -34,6 +44,11 @@ CacheContext::~CacheContext()
     newInstancesThread_.join();
   }
 
+  if (openedStudiesThread_.joinable())
+  {
+    openedStudiesThread_.join();
+  }
+
   scheduler_.reset(NULL);
   cacheManager_.reset(NULL);
 }
@@ -64,17 +79,13 @@ void CacheContext::NewInstancesThread(CacheContext* that)
           std::string seriesId = instance["ParentSeries"].asString();
           that->logger_->LogCacheDebugInfo("newInstancesThread: invalidating series " + seriesId);
           that->GetScheduler().Invalidate(OrthancPlugins::CacheBundle_SeriesInformation, seriesId);
+          that->seriesRepository_->InvalidateSeriesDescriptor(seriesId);
 
           // also start pre-computing the images for the instance
           if (that->prefetchOnInstanceStored_)
           {
             try {
-              std::auto_ptr<Series> series = that->seriesRepository_->GetSeries(seriesId);  // TODO: clarify difference between series cache and series repository (there's clearly a lot of redundancy there !)
-
-              std::vector<ImageQuality::EImageQuality> qualitiesToPrefetch = series->GetOrderedImageQualities();
-              BOOST_FOREACH(ImageQuality quality, qualitiesToPrefetch) {
-                that->GetScheduler().Prefetch(OrthancPlugins::CacheBundle_DecodedImage, instanceId + "/0/" + quality.toProcessingPolicytString()); // TODO: for multi-frame images, we should prefetch all frames and not onlyt the first one !
-              }
+              that->PrefetchNewInstance(instanceId, seriesId, instance);
             } catch (Orthanc::OrthancException& ex) {
               OrthancPluginLogWarning(that->pluginContext_, (std::string("Exception while trying to prefetch instances: ") + ex.What()).c_str());
             } catch (...) {
@@ -92,6 +103,159 @@ void CacheContext::NewInstancesThread(CacheContext* that)
   }
 }
 
+
+void CacheContext::PrefetchNewInstance(const std::string& instanceId,
+                                       const std::string& seriesId,
+                                       const Json::Value& instance)
+{
+  const SeriesDescriptor series = seriesRepository_->GetSeriesDescriptor(seriesId);
+  std::vector<ImageQuality::EImageQuality> qualitiesToPrefetch = series.GetOrderedImageQualities();
+  if (qualitiesToPrefetch.empty())
+  {
+    return;
+  }
+
+  unsigned int framesCount = 1;
+  if (instance["MainDicomTags"].isMember("NumberOfFrames"))
+  {
+    try
+    {
+      framesCount = std::max(boost::lexical_cast<unsigned int>(Orthanc::Toolbox::StripSpaces(instance["MainDicomTags"]["NumberOfFrames"].asString())), 1u);
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+    }
+  }
+
+  // Apply the budget of the instance, the first frame is always prefetched
+  unsigned int toPrefetch = framesCount;
+  if (instancePrefetchMaxFrames_ != 0)
+  {
+    toPrefetch = std::min(toPrefetch, instancePrefetchMaxFrames_);
+  }
+
+  // Same estimate of the size of a decoded frame as the ImageRepository
+  // (16 bits per pixel), the frames of an instance share the same size
+  const uint64_t frameSize = static_cast<uint64_t>(series.columns) * series.rows * 2 * qualitiesToPrefetch.size();
+  if (instancePrefetchMaxBytes_ != 0 &&
+      frameSize != 0)
+  {
+    toPrefetch = static_cast<unsigned int>(std::min(static_cast<uint64_t>(toPrefetch),
+                                                    std::max(instancePrefetchMaxBytes_ / frameSize, static_cast<uint64_t>(1))));
+  }
+
+  if (toPrefetch < framesCount)
+  {
+    logger_->LogCacheDebugInfo("newInstancesThread: prefetching " + boost::lexical_cast<std::string>(toPrefetch) +
+                               " of the " + boost::lexical_cast<std::string>(framesCount) + " frames of " + instanceId);
+  }
+
+  // The lowest quality of all the frames goes first, in the order of the
+  // frames. The qualities of a frame are then created from a single
+  // decoding, and the frames are decoded one after the other from the
+  // DICOM file that the DicomRepository keeps in memory.
+  OrthancPlugins::PrefetchBatch batch;
+
+  for (size_t q = 0; q < qualitiesToPrefetch.size(); q++)
+  {
+    const std::string quality = ImageQuality(qualitiesToPrefetch[q]).toProcessingPolicytString();
+
+    for (unsigned int frame = 0; frame < toPrefetch; frame++)
+    {
+      OrthancPlugins::CacheIndex item(OrthancPlugins::CacheBundle_DecodedImage,
+                                      instanceId + "/" + boost::lexical_cast<std::string>(frame) + "/" + quality,
+                                      static_cast<unsigned int>(q), frame, "");
+
+      // The other frames of a cine loop must not delay the prefetches of
+      // the series that are being displayed
+      item.SetBackground(frame > 0);
+      batch.AddItem(item);
+    }
+  }
+
+  GetScheduler().Prefetch(batch);
+}
+
+
+void CacheContext::PrefetchOpenedStudy(const OpenedStudy& study)
+{
+  const std::vector<std::string>& seriesIds = study.GetSeriesIds();
+
+  // The middle frames (thumbnails) of all the series go first, then
+  // their first frames, both in the display order of the series
+  OrthancPlugins::PrefetchBatch batch;
+
+  for (size_t i = 0; i < seriesIds.size() && !stop_; i++)
+  {
+    try {
+      std::vector<ImageQuality::EImageQuality> qualities = seriesRepository_->GetSeriesDescriptor(seriesIds[i]).GetOrderedImageQualities();
+      if (qualities.empty())
+      {
+        continue;
+      }
+
+      // Building the series information must not move the prefetch
+      // window of the policy, as the user has not opened this series yet
+      std::string content;
+      if (!GetScheduler().AccessInBackground(content, OrthancPlugins::CacheBundle_SeriesInformation, seriesIds[i]))
+      {
+        continue;
+      }
+
+      OrthancPlugins::SeriesSliceIndex index(content);
+      if (index.GetSize() == 0)
+      {
+        continue;
+      }
+
+      const OrthancPlugins::PrefetchRange::Slices& slices = *index.GetSlices();
+      const std::string quality = ImageQuality(qualities.front()).toProcessingPolicytString();
+
+      std::vector<std::string> items;
+      items.push_back(slices[slices.size() / 2]);
+      if (slices.size() > 1)
+      {
+        items.push_back(slices[0]);
+      }
+
+      for (size_t j = 0; j < items.size(); j++)
+      {
+        OrthancPlugins::CacheIndex item(OrthancPlugins::CacheBundle_DecodedImage, items[j] + "/" + quality,
+                                        0, static_cast<unsigned int>(j * seriesIds.size() + i), "");
+        item.SetBackground(true);
+        batch.AddItem(item);
+      }
+    } catch (Orthanc::OrthancException& ex) {
+      OrthancPluginLogWarning(pluginContext_, (std::string("Exception while trying to prefetch series ") + seriesIds[i] + ": " + ex.What()).c_str());
+    }
+  }
+
+  GetScheduler().Prefetch(batch);
+}
+
+
+void CacheContext::OpenedStudiesThread(CacheContext* that)
+{
+  while (!that->stop_)
+  {
+    try {
+      std::auto_ptr<Orthanc::IDynamicObject> obj(that->openedStudies_.Dequeue(100));
+      if (obj.get() != NULL)
+      {
+        const OpenedStudy& study = dynamic_cast<OpenedStudy&>(*obj);
+
+        that->logger_->LogCacheDebugInfo("openedStudiesThread: prefetching study " + study.GetStudyId());
+        that->PrefetchOpenedStudy(study);
+        that->logger_->LogCacheDebugInfo("openedStudiesThread: done handling " + study.GetStudyId());
+      }
+    } catch (Orthanc::OrthancException& ex) {
+      OrthancPluginLogWarning(that->pluginContext_, (std::string("Exception in openedStudiesThread: ") + ex.What()).c_str());
+    } catch (...) {
+      OrthancPluginLogError(that->pluginContext_, (std::string("Unexpected exception in openedStudiesThread")).c_str());
+    }
+  }
+}
+
 void CacheLogger::LogCacheDebugInfo(const std::string& message)
 {
   if (debugLogsEnabled_)
@@ -7,7 +7,7 @@
 #include "Core/FileStorage/FilesystemStorage.h"
 #include "Core/SQLite/Connection.h"
 #include "Plugins/Samples/GdcmDecoder/GdcmDecoderCache.h"
-#include "CacheManager.h"
+#include "ShardedCacheManager.h"
 #include "CacheScheduler.h"
 #include "json/json.h"
 #include "ViewerToolbox.h"
@@ -54,11 +54,34 @@ private:
     }
   };
 
+  class OpenedStudy : public Orthanc::IDynamicObject
+  {
+  private:
+    std::string               studyId_;
+    std::vector<std::string>  seriesIds_;
+
+  public:
+    OpenedStudy(const std::string& studyId,
+                const std::vector<std::string>& seriesIds) :
+      studyId_(studyId),
+      seriesIds_(seriesIds)
+    {
+    }
+
+    const std::string& GetStudyId() const
+    {
+      return studyId_;
+    }
+
+    const std::vector<std::string>& GetSeriesIds() const
+    {
+      return seriesIds_;
+    }
+  };
+
   OrthancPluginContext* pluginContext_;
-  Orthanc::FilesystemStorage  storage_;
-  Orthanc::SQLite::Connection  db_;
 
-  std::auto_ptr<OrthancPlugins::CacheManager>  cacheManager_;
+  std::auto_ptr<OrthancPlugins::ShardedCacheManager>  cacheManager_;
   std::auto_ptr<OrthancPlugins::CacheScheduler>  scheduler_;
   std::auto_ptr<CacheLogger> logger_;
   SeriesRepository* seriesRepository_;
@@ -68,15 +91,32 @@ private:
   boost::thread newInstancesThread_;
   OrthancPlugins::GdcmDecoderCache  decoder_;
   bool prefetchOnInstanceStored_;
+  unsigned int instancePrefetchMaxFrames_;
+  uint64_t instancePrefetchMaxBytes_;
+
+  Orthanc::SharedMessageQueue  openedStudies_;
+  boost::thread openedStudiesThread_;
+  bool prefetchOnStudyOpened_;
 
   static void NewInstancesThread(CacheContext* cache);
 
+  static void OpenedStudiesThread(CacheContext* cache);
+
+  void PrefetchNewInstance(const std::string& instanceId,
+                           const std::string& seriesId,
+                           const Json::Value& instance);
+
+  void PrefetchOpenedStudy(const OpenedStudy& study);
+
 public:
 
   CacheContext(const std::string& path,
+               size_t shardsCount,
+               size_t threadsCount,
                OrthancPluginContext* pluginContext,
                bool debugLogsEnabled,
                bool prefetchOnInstanceStored,
+               bool prefetchOnStudyOpened,
                SeriesRepository* seriesRepository);
   ~CacheContext();
 
@@ -85,6 +125,17 @@ public:
     return *scheduler_;
   }
 
+  // Bounds the number of frames of a new instance that are prefetched
+  // (0 for no limit), and the size of these frames once decoded, for
+  // all their qualities (0 for no limit). Must be called before the
+  // first new instance is signaled.
+  void SetInstancePrefetchBudget(unsigned int maxFrames,
+                                 uint64_t maxBytes)
+  {
+    instancePrefetchMaxFrames_ = maxFrames;
+    instancePrefetchMaxBytes_ = maxBytes;
+  }
+
   CacheLogger* GetLogger()
   {
     return logger_.get();
@@ -96,6 +147,20 @@ public:
     newInstances_.Enqueue(new DynamicString(instanceId));
   }
 
+  // Prefetches in the background the low quality middle and first
+  // frames of the series of a study, in their display order, so that
+  // the thumbnails and the first paint of a series are served from the
+  // cache
+  void SignalOpenedStudy(const std::string& studyId,
+                         const std::vector<std::string>& seriesIds)
+  {
+    if (prefetchOnStudyOpened_)
+    {
+      logger_->LogCacheDebugInfo("enqueuing opened study " + studyId);
+      openedStudies_.Enqueue(new OpenedStudy(studyId, seriesIds));
+    }
+  }
+
   OrthancPlugins::GdcmDecoderCache&  GetDecoder()
   {
     return decoder_;
@@ -0,0 +1,187 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "CacheExecutor.h"
+
+#include <algorithm>
+
+// Delay before an idle thread looks again at the queues that had tasks,
+// but did not allow to run them (e.g. because of throttling)
+static const unsigned int RETRY_DELAY_MS = 100;
+
+namespace OrthancPlugins
+{
+  void CacheExecutor::ListCandidates(std::vector<IQueue*>& candidates)
+  {
+    // Smooth weighted round-robin: the queue with the most credit is
+    // tried first. The other queues are tried next, in their order, in
+    // case the first one is empty.
+    boost::mutex::scoped_lock lock(mutex_);
+
+    candidates.clear();
+
+    if (sources_.empty())
+    {
+      return;
+    }
+
+    int64_t total = 0;
+    size_t best = 0;
+
+    for (size_t i = 0; i < sources_.size(); i++)
+    {
+      sources_[i].credit_ += sources_[i].weight_;
+      total += sources_[i].weight_;
+
+      if (sources_[i].credit_ > sources_[best].credit_)
+      {
+        best = i;
+      }
+    }
+
+    sources_[best].credit_ -= total;
+
+    candidates.reserve(sources_.size());
+    for (size_t i = 0; i < sources_.size(); i++)
+    {
+      candidates.push_back(sources_[(best + i) % sources_.size()].queue_);
+    }
+  }
+
+
+  void CacheExecutor::Worker(CacheExecutor* that)
+  {
+    std::vector<IQueue*> candidates;
+
+    for (;;)
+    {
+      uint64_t signals;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+        if (that->done_)
+        {
+          return;
+        }
+
+        signals = that->signals_;
+      }
+
+      bool found = false;
+
+      try
+      {
+        that->ListCandidates(candidates);
+
+        for (size_t i = 0; i < candidates.size() && !found; i++)
+        {
+          found = candidates[i]->RunOne();
+        }
+      }
+      catch (...)
+      {
+        OrthancPluginLogError(that->context_, "Unhandled native exception inside the executor of the Web viewer cache");
+        found = true;
+      }
+
+      if (!found)
+      {
+        // All the queues are empty or throttled, sleep until a new task
+        // is signaled. The timeout retries the throttled queues.
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        if (!that->done_ &&
+            that->signals_ == signals)
+        {
+          that->wakeup_.timed_wait(lock, boost::posix_time::milliseconds(RETRY_DELAY_MS));
+        }
+      }
+    }
+  }
+
+
+  CacheExecutor::CacheExecutor(OrthancPluginContext* context,
+                               size_t threadsCount) :
+    context_(context),
+    signals_(0),
+    done_(false)
+  {
+    threadsCount = std::max(threadsCount, static_cast<size_t>(1));
+
+    threads_.resize(threadsCount, NULL);
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      threads_[i] = new boost::thread(Worker, this);
+    }
+  }
+
+
+  CacheExecutor::~CacheExecutor()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      done_ = true;
+      wakeup_.notify_all();
+    }
+
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+      if (threads_[i] != NULL)
+      {
+        if (threads_[i]->joinable())
+        {
+          threads_[i]->join();
+        }
+
+        delete threads_[i];
+      }
+    }
+  }
+
+
+  void CacheExecutor::Register(IQueue& queue,
+                               unsigned int weight)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Source source;
+    source.queue_ = &queue;
+    source.weight_ = std::max(weight, 1u);
+    source.credit_ = 0;
+    sources_.push_back(source);
+  }
+
+
+  void CacheExecutor::Signal()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    signals_++;
+    wakeup_.notify_one();
+  }
+
+
+  void CacheExecutor::SignalAll()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    signals_++;
+    wakeup_.notify_all();
+  }
+}
@@ -0,0 +1,98 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <vector>
+#include <stdint.h>
+
+namespace OrthancPlugins
+{
+  // Pool of threads shared by all the bundles of the cache, instead of
+  // one set of threads per bundle. The threads pull the tasks from the
+  // registered queues, each queue getting a share of the threads that
+  // is proportional to its weight while it has pending tasks. An idle
+  // queue does not hold any thread.
+  class CacheExecutor : public boost::noncopyable
+  {
+  public:
+    class IQueue : public boost::noncopyable
+    {
+    public:
+      virtual ~IQueue()
+      {
+      }
+
+      // Runs one of the pending tasks of the queue, if any, and returns
+      // "false" if the queue is empty or cannot run a task for now.
+      // Called concurrently by the threads of the executor, must not
+      // block while waiting for tasks.
+      virtual bool RunOne() = 0;
+    };
+
+  private:
+    struct Source
+    {
+      IQueue*       queue_;
+      unsigned int  weight_;
+      int64_t       credit_;
+    };
+
+    OrthancPluginContext*        context_;
+    boost::mutex                 mutex_;
+    boost::condition_variable    wakeup_;
+    std::vector<Source>          sources_;
+    uint64_t                     signals_;
+    bool                         done_;
+    std::vector<boost::thread*>  threads_;
+
+    static void Worker(CacheExecutor* that);
+
+    void ListCandidates(std::vector<IQueue*>& candidates);
+
+  public:
+    CacheExecutor(OrthancPluginContext* context,
+                  size_t threadsCount);
+
+    // Waits for the running tasks to finish, the pending ones are dropped
+    ~CacheExecutor();
+
+    size_t GetThreadsCount() const
+    {
+      return threads_.size();
+    }
+
+    // The queue must outlive the executor
+    void Register(IQueue& queue,
+                  unsigned int weight);
+
+    // Must be called each time a task is added to one of the queues
+    void Signal();
+
+    // Same as Signal(), when several tasks were added at once: wakes up
+    // all the idle threads
+    void SignalAll();
+  };
+}
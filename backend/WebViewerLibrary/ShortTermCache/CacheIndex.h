@@ -33,17 +33,44 @@ namespace OrthancPlugins
     int          bundle_;
     std::string  item_;
 
+    // Prefetching hints, not part of the identity of the item
+    unsigned int  qualityRank_;
+    unsigned int  distance_;
+    std::string   group_;
+    bool          background_;
+
   public:
     CacheIndex(const CacheIndex& other) :
     bundle_(other.bundle_),
-    item_(other.item_)
+    item_(other.item_),
+    qualityRank_(other.qualityRank_),
+    distance_(other.distance_),
+    group_(other.group_),
+    background_(other.background_)
     {
     }
 
     CacheIndex(int bundle,
                const std::string& item) :
       bundle_(bundle),
-      item_(item)
+      item_(item),
+      qualityRank_(0),
+      distance_(0),
+      background_(false)
+    {
+    }
+
+    CacheIndex(int bundle,
+               const std::string& item,
+               unsigned int qualityRank,
+               unsigned int distance,
+               const std::string& group) :
+      bundle_(bundle),
+      item_(item),
+      qualityRank_(qualityRank),
+      distance_(distance),
+      group_(group),
+      background_(false)
     {
     }
 
@@ -57,6 +84,38 @@ namespace OrthancPlugins
       return item_;
     }
 
+    // Rank of the quality of the image among the qualities of its series
+    // (0 for the first one to display)
+    unsigned int GetQualityRank() const
+    {
+      return qualityRank_;
+    }
+
+    // Distance, in slices, to the slice that is displayed
+    unsigned int GetDistance() const
+    {
+      return distance_;
+    }
+
+    // Group of prefetches this item belongs to (e.g. its series), whose
+    // former requests are superseded by this one
+    const std::string& GetGroup() const
+    {
+      return group_;
+    }
+
+    // A background prefetch is speculative: it only comes after all the
+    // other pending prefetches, except the superseded ones
+    bool IsBackground() const
+    {
+      return background_;
+    }
+
+    void SetBackground(bool background)
+    {
+      background_ = background;
+    }
+
     bool operator== (const CacheIndex& other) const
     {
       return (bundle_ == other.bundle_ &&
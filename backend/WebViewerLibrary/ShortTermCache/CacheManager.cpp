@@ -20,12 +20,35 @@
 
 
 #include "CacheManager.h"
+#include "CacheReaper.h"
+#include "SegmentStorage.h"
 
 #include "Core/Toolbox.h"
 #include "Core/SQLite/Transaction.h"
 
+#include <boost/algorithm/string/predicate.hpp>
 #include <boost/lexical_cast.hpp>
-
+#include <boost/unordered_map.hpp>
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <set>
+#include <vector>
+
+// Number of cache hits that are accumulated in memory before their
+// recency is written back to the "Cache" table
+static const size_t ACCESS_LOG_FLUSH_SIZE = 1000;
+
+// Once a bundle exceeds its quota (the high watermark), the eviction
+// frees entries until the bundle is below this percentage of the quota,
+// so that the next Store() calls do not trigger an eviction each
+static const unsigned int LOW_WATERMARK_PERCENT = 90;
+
+// Maximum number of items, and of bytes, that are moved by one pass of
+// the compaction. The items are read without the lock, but they are
+// appended to the current segment with it.
+static const size_t COMPACTION_BATCH_SIZE = 256;
+static const uint64_t COMPACTION_BATCH_BYTES = 4 * 1024 * 1024;
 
 namespace OrthancPlugins
 {
@@ -81,11 +104,13 @@ namespace OrthancPlugins
   private:   
     uint32_t maxCount_;
     uint64_t maxSpace_;
+    CacheEvictionPolicy policy_;
 
   public:
     BundleQuota(uint32_t maxCount,
-                uint64_t maxSpace) : 
-      maxCount_(maxCount), maxSpace_(maxSpace)
+                uint64_t maxSpace,
+                CacheEvictionPolicy policy) : 
+      maxCount_(maxCount), maxSpace_(maxSpace), policy_(policy)
     {
     }
 
@@ -94,6 +119,12 @@ namespace OrthancPlugins
       // Default quota
       maxCount_ = 0;  // No limit on the number of files
       maxSpace_ = 100 * 1024 * 1024;  // Max 100MB per bundle
+      policy_ = CacheEvictionPolicy_LeastRecentlyUsed;
+    }
+
+    CacheEvictionPolicy GetPolicy() const
+    {
+      return policy_;
     }
 
     uint32_t GetMaxCount() const
@@ -122,6 +153,43 @@ namespace OrthancPlugins
 
       return true;
     }
+
+    bool IsBelowLowWatermark(const Bundle& bundle) const
+    {
+      if (maxCount_ != 0 &&
+          static_cast<uint64_t>(bundle.GetCount()) * 100 > static_cast<uint64_t>(maxCount_) * LOW_WATERMARK_PERCENT)
+      {
+        return false;
+      }
+
+      if (maxSpace_ != 0 &&
+          bundle.GetSpace() * 100 > maxSpace_ * LOW_WATERMARK_PERCENT)
+      {
+        return false;
+      }
+
+      return true;
+    }
+  };
+
+
+  struct CacheManager::IndexEntry
+  {
+    int64_t      seq_;
+    std::string  uuid_;
+    uint64_t     size_;
+
+    // Only used by the GreedyDual-Size-Frequency policy. The number of
+    // hits is not persisted, it restarts from 1 after a restart.
+    uint32_t     cost_;
+    uint32_t     hits_;
+    double       priority_;
+
+    // Position in the access log, and seq to be written back by
+    // FlushAccessLog(), only valid if "logged_" is true
+    bool                              logged_;
+    std::list<IndexEntry*>::iterator  position_;
+    int64_t                           loggedSeq_;
   };
 
 
@@ -130,19 +198,63 @@ namespace OrthancPlugins
     OrthancPluginContext* context_;
     Orthanc::SQLite::Connection& db_;
     Orthanc::FilesystemStorage& storage_;
+    CacheReaper* reaper_;
+    SegmentStorage* segments_;
+    std::set<int> segmentBundles_;
 
     bool sanityCheck_;
     Bundles  bundles_;
     BundleQuota  defaultQuota_;
     BundleQuotas  quotas_;
 
+    // In-memory copy of the "Cache" table, loaded once at startup. The
+    // lookups never query SQLite: the table is only kept up-to-date so
+    // that the index can be rebuilt at the next start.
+    typedef boost::unordered_map<std::string, IndexEntry>  ItemIndex;
+
+    struct BundleIndex
+    {
+      ItemIndex              items_;
+      std::set<std::string>  sorted_;   // Same keys, sorted for the prefix lookups of Invalidate()
+    };
+
+    typedef std::map<int, BundleIndex>  Index;
+    Index  index_;
+
+    // The bundle and the item of the entries that are stored in the
+    // segments, by address. The addresses of a segment share the same
+    // prefix, so that the compaction does not scan the whole index.
+    typedef std::map<std::string, std::pair<int, std::string> >  SegmentItems;
+    SegmentItems  segmentItems_;
+
+    // Entries hit since the last flush, ordered by their last access. A
+    // hit does not rewrite its row anymore: the recency is written back
+    // in batches (see FlushAccessLog()).
+    typedef std::list<IndexEntry*>  AccessLog;
+    AccessLog  accessLog_;
+
+    // Last seq given to a hit or to an insert. Both share this clock, so
+    // that a hit that is written back later keeps its place in the LRU
+    // order with respect to the items that were stored meanwhile.
+    int64_t  clock_;
+
+    // Inflation value of the GreedyDual-Size-Frequency policy for each
+    // bundle: the priority of the last evicted item. It is added to the
+    // priority of the items that are stored or hit, so that the items
+    // that are not used anymore eventually get evicted.
+    typedef std::map<int, double>  Inflations;
+    Inflations  inflations_;
+
     PImpl(OrthancPluginContext* context,
           Orthanc::SQLite::Connection& db,
           Orthanc::FilesystemStorage& storage) :
       context_(context),
       db_(db), 
       storage_(storage), 
-      sanityCheck_(false)
+      reaper_(NULL),
+      segments_(NULL),
+      sanityCheck_(false),
+      clock_(0)
     {
     }
   };
@@ -178,6 +290,83 @@ namespace OrthancPlugins
   }
 
 
+  static double ComputePriority(double inflation,
+                                uint32_t hits,
+                                uint32_t cost,
+                                uint64_t size)
+  {
+    // GreedyDual-Size-Frequency: the creation cost is never null, so
+    // that the frequency is still accounted for the cheapest items
+    return (inflation + 
+            static_cast<double>(hits) * static_cast<double>(std::max<uint32_t>(cost, 1)) /
+            static_cast<double>(std::max<uint64_t>(size, 1)));
+  }
+
+
+  void CacheManager::UpdatePriority(int bundleIndex,
+                                    IndexEntry& entry)
+  {
+    entry.priority_ = ComputePriority(pimpl_->inflations_[bundleIndex], entry.hits_, entry.cost_, entry.size_);
+  }
+
+
+  void CacheManager::MakeRoomByCost(Bundle& bundle,
+                                    std::list<std::string>& toRemove,
+                                    int bundleIndex,
+                                    const BundleQuota& quota)
+  {
+    using namespace Orthanc;
+
+    typedef std::pair<double, const std::string*>  Candidate;
+    std::vector<Candidate> candidates;
+
+    PImpl::BundleIndex& index = pimpl_->index_[bundleIndex];
+    candidates.reserve(index.items_.size());
+
+    for (PImpl::ItemIndex::const_iterator it = index.items_.begin(); it != index.items_.end(); ++it)
+    {
+      candidates.push_back(std::make_pair(it->second.priority_, &it->first));
+    }
+
+    // Evict the items with the lowest priority first, until enough room
+    // is freed to go below the low watermark
+    std::sort(candidates.begin(), candidates.end());
+
+    std::list<std::string> items;
+    double inflation = pimpl_->inflations_[bundleIndex];
+
+    for (size_t i = 0; !quota.IsBelowLowWatermark(bundle); i++)
+    {
+      if (i == candidates.size())
+      {
+        // Should never happen
+        throw std::runtime_error("Internal error");
+      }
+
+      const std::string& item = *candidates[i].second;
+      const IndexEntry* entry = LookupIndex(bundleIndex, item);
+      assert(entry != NULL);
+
+      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
+      s.BindInt64(0, entry->seq_);
+      s.Run();
+
+      toRemove.push_back(entry->uuid_);
+      bundle.Remove(entry->size_);
+      items.push_back(item);
+
+      inflation = std::max(inflation, candidates[i].first);
+    }
+
+    pimpl_->inflations_[bundleIndex] = inflation;
+
+    for (std::list<std::string>::const_iterator it = items.begin(); it != items.end(); ++it)
+    {
+      RemoveFromIndex(bundleIndex, *it);
+    }
+  }
+
+
   void CacheManager::MakeRoom(Bundle& bundle,
                               std::list<std::string>& toRemove,
                               int bundleIndex,
@@ -187,26 +376,53 @@ namespace OrthancPlugins
 
     toRemove.clear();
 
-    // Make room in the bundle
-    while (!quota.IsSatisfied(bundle))
+    if (quota.IsSatisfied(bundle))
+    {
+      return;
+    }
+
+    if (quota.GetPolicy() == CacheEvictionPolicy_GreedyDualSizeFrequency)
     {
-      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? ORDER BY seq");
+      MakeRoomByCost(bundle, toRemove, bundleIndex, quota);
+      return;
+    }
+
+    // The LRU order must account for the pending hits before evicting
+    FlushAccessLog();
+
+    // Walk the bundle from the least recently used entry, until enough
+    // room is freed to go below the low watermark
+    std::list<std::string> items;
+    int64_t last = 0;
+
+    {
+      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize, item FROM Cache WHERE bundle=? ORDER BY seq");
       s.BindInt(0, bundleIndex);
 
-      if (s.Step())
+      while (!quota.IsBelowLowWatermark(bundle))
       {
-        SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-        t.BindInt64(0, s.ColumnInt64(0));
-        t.Run();
+        if (!s.Step())
+        {
+          // Should never happen
+          throw std::runtime_error("Internal error");
+        }
 
+        last = s.ColumnInt64(0);
         toRemove.push_back(s.ColumnString(1));
         bundle.Remove(s.ColumnInt64(2));
+        items.push_back(s.ColumnString(3));
       }
-      else
-      {
-        // Should never happen
-        throw std::runtime_error("Internal error");
-      }
+    }
+
+    // Evict all these entries at once
+    SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE bundle=? AND seq<=?");
+    t.BindInt(0, bundleIndex);
+    t.BindInt64(1, last);
+    t.Run();
+
+    for (std::list<std::string>::const_iterator it = items.begin(); it != items.end(); ++it)
+    {
+      RemoveFromIndex(bundleIndex, *it);
     }
   }
 
@@ -227,30 +443,260 @@ namespace OrthancPlugins
     MakeRoom(bundle, toRemove, bundleIndex, quota);
 
     transaction->Commit();
+    RemoveFiles(toRemove);
+
+    pimpl_->bundles_[bundleIndex] = bundle;
+  }
+
+
+
+  void CacheManager::LogAccess(IndexEntry& entry)
+  {
+    entry.loggedSeq_ = ++pimpl_->clock_;
+
+    if (entry.logged_)
+    {
+      // Already hit since the last flush, only its position changes
+      pimpl_->accessLog_.splice(pimpl_->accessLog_.end(), pimpl_->accessLog_, entry.position_);
+    }
+    else
+    {
+      entry.position_ = pimpl_->accessLog_.insert(pimpl_->accessLog_.end(), &entry);
+      entry.logged_ = true;
+    }
+  }
+
+
+  void CacheManager::ForgetAccess(IndexEntry& entry)
+  {
+    // Must be called whenever an entry is removed from the index
+    if (entry.logged_)
+    {
+      pimpl_->accessLog_.erase(entry.position_);
+      entry.logged_ = false;
+    }
+  }
+
+
+  void CacheManager::FlushAccessLog()
+  {
+    // Must be called from within a transaction. Each row takes the seq
+    // that the clock gave to its last hit, which is above the seq of all
+    // the rows stored before this hit, and below the ones stored after:
+    // this gives the very same LRU order as the former DELETE+INSERT that
+    // was done at each hit.
+    using namespace Orthanc;
+
+    for (PImpl::AccessLog::const_iterator
+           it = pimpl_->accessLog_.begin(); it != pimpl_->accessLog_.end(); ++it)
+    {
+      IndexEntry& entry = **it;
+
+      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "UPDATE Cache SET seq=? WHERE seq=?");
+      s.BindInt64(0, entry.loggedSeq_);
+      s.BindInt64(1, entry.seq_);
+      s.Run();
+
+      entry.seq_ = entry.loggedSeq_;
+      entry.logged_ = false;
+    }
+
+    pimpl_->accessLog_.clear();
+  }
+
+
+  void CacheManager::RemoveFile(const std::string& uuid)
+  {
+    if (SegmentStorage::IsSegmentAddress(uuid))
+    {
+      if (pimpl_->segments_ != NULL)
+      {
+        pimpl_->segments_->Remove(uuid);
+      }
+    }
+    else
+    {
+      pimpl_->storage_.Remove(uuid, Orthanc::FileContentType_Unknown);
+    }
+  }
+
+
+  void CacheManager::RemoveFiles(const std::list<std::string>& uuids)
+  {
     for (std::list<std::string>::const_iterator
-           it = toRemove.begin(); it != toRemove.end(); it++)
+           it = uuids.begin(); it != uuids.end(); ++it)
     {
-      pimpl_->storage_.Remove(*it, Orthanc::FileContentType_Unknown);
+      if (pimpl_->reaper_ != NULL &&
+          !SegmentStorage::IsSegmentAddress(*it))
+      {
+        pimpl_->reaper_->Remove(pimpl_->storage_, *it);
+      }
+      else
+      {
+        // Removing an item from a segment is only bookkeeping
+        RemoveFile(*it);
+      }
     }
+  }
 
-    pimpl_->bundles_[bundleIndex] = bundle;
+
+  void CacheManager::ReleaseFiles(const std::list<std::string>& uuids)
+  {
+    RemoveFiles(uuids);
+
+    // The segments left without any live item are handed to the
+    // reaper, which waits for the readers that still pin them
+    if (pimpl_->segments_ != NULL)
+    {
+      pimpl_->segments_->RemoveDeadSegments();
+    }
+  }
+
+
+  void CacheManager::RecoverSegments()
+  {
+    using namespace Orthanc;
+
+    typedef std::list< std::pair<int, std::string> >  LostItems;
+    LostItems lost;
+
+    for (PImpl::Index::const_iterator bundle = pimpl_->index_.begin(); bundle != pimpl_->index_.end(); ++bundle)
+    {
+      for (PImpl::ItemIndex::const_iterator it = bundle->second.items_.begin(); it != bundle->second.items_.end(); ++it)
+      {
+        if (SegmentStorage::IsSegmentAddress(it->second.uuid_) &&
+            !pimpl_->segments_->Recover(it->second.uuid_))
+        {
+          lost.push_back(std::make_pair(bundle->first, it->first));
+        }
+      }
+    }
+
+    if (!lost.empty())
+    {
+      std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+      transaction->Begin();
+
+      for (LostItems::const_iterator it = lost.begin(); it != lost.end(); ++it)
+      {
+        const IndexEntry* entry = LookupIndex(it->first, it->second);
+        assert(entry != NULL);
+
+        SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
+        t.BindInt64(0, entry->seq_);
+        t.Run();
+
+        pimpl_->bundles_[it->first].Remove(entry->size_);
+      }
+
+      transaction->Commit();
+
+      for (LostItems::const_iterator it = lost.begin(); it != lost.end(); ++it)
+      {
+        RemoveFromIndex(it->first, it->second);
+      }
+
+      OrthancPluginLogWarning(pimpl_->context_, ("Dropped " + boost::lexical_cast<std::string>(lost.size()) +
+                                                 " items that were not completely written to the cache of the Web viewer").c_str());
+    }
+
+    pimpl_->segments_->RemoveDeadSegments();
   }
 
 
 
-  void CacheManager::ReadBundleStatistics()
+  void CacheManager::ReadIndex()
   {
     using namespace Orthanc;
 
     pimpl_->bundles_.clear();
+    pimpl_->index_.clear();
+    pimpl_->segmentItems_.clear();
+    pimpl_->accessLog_.clear();
 
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT bundle,COUNT(*),SUM(fileSize) FROM Cache GROUP BY bundle");
+    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, bundle, item, fileUuid, fileSize, cost FROM Cache");
     while (s.Step())
     {
-      int index = s.ColumnInt(0);
-      Bundle bundle(static_cast<uint32_t>(s.ColumnInt(1)),
-                    static_cast<uint64_t>(s.ColumnInt64(2)));
-      pimpl_->bundles_[index] = bundle;
+      int bundleIndex = s.ColumnInt(1);
+
+      IndexEntry entry;
+      entry.seq_ = s.ColumnInt64(0);
+      entry.uuid_ = s.ColumnString(3);
+      entry.size_ = static_cast<uint64_t>(s.ColumnInt64(4));
+      entry.cost_ = static_cast<uint32_t>(s.ColumnInt(5));
+      entry.hits_ = 1;
+      entry.logged_ = false;
+      UpdatePriority(bundleIndex, entry);
+
+      pimpl_->clock_ = std::max(pimpl_->clock_, entry.seq_);
+
+      if (AddToIndex(bundleIndex, s.ColumnString(2), entry))
+      {
+        pimpl_->bundles_[bundleIndex].Add(entry.size_);
+      }
+    }
+  }
+
+
+  CacheManager::IndexEntry* CacheManager::LookupIndex(int bundleIndex,
+                                                      const std::string& item)
+  {
+    PImpl::Index::iterator bundle = pimpl_->index_.find(bundleIndex);
+    if (bundle == pimpl_->index_.end())
+    {
+      return NULL;
+    }
+
+    PImpl::ItemIndex::iterator found = bundle->second.items_.find(item);
+    if (found == bundle->second.items_.end())
+    {
+      return NULL;
+    }
+    else
+    {
+      return &found->second;
+    }
+  }
+
+
+  bool CacheManager::AddToIndex(int bundleIndex,
+                                const std::string& item,
+                                const IndexEntry& entry)
+  {
+    PImpl::BundleIndex& bundle = pimpl_->index_[bundleIndex];
+
+    if (bundle.items_.insert(std::make_pair(item, entry)).second)
+    {
+      bundle.sorted_.insert(item);
+
+      if (SegmentStorage::IsSegmentAddress(entry.uuid_))
+      {
+        pimpl_->segmentItems_[entry.uuid_] = std::make_pair(bundleIndex, item);
+      }
+
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  void CacheManager::RemoveFromIndex(int bundleIndex,
+                                     const std::string& item)
+  {
+    PImpl::Index::iterator bundle = pimpl_->index_.find(bundleIndex);
+    if (bundle != pimpl_->index_.end())
+    {
+      PImpl::ItemIndex::iterator found = bundle->second.items_.find(item);
+      if (found != bundle->second.items_.end())
+      {
+        ForgetAccess(found->second);
+        pimpl_->segmentItems_.erase(found->second.uuid_);
+        bundle->second.items_.erase(found);
+        bundle->second.sorted_.erase(item);
+      }
     }
   }
 
@@ -277,6 +723,13 @@ namespace OrthancPlugins
                                  + " vs " + boost::lexical_cast<std::string>(s.ColumnInt(1)) + "/"
                                  + boost::lexical_cast<std::string>(s.ColumnInt64(2)));
       }
+
+      const PImpl::BundleIndex& index = pimpl_->index_[s.ColumnInt(0)];
+      if (index.items_.size() != static_cast<size_t>(s.ColumnInt(1)) ||
+          index.sorted_.size() != index.items_.size())
+      {
+        throw std::runtime_error("SANITY ERROR in the index of the cache");
+      }
     }
   }
 
@@ -288,7 +741,24 @@ namespace OrthancPlugins
     pimpl_(new PImpl(context, db, storage))
   {
     Open();
-    ReadBundleStatistics();
+    ReadIndex();
+  }
+
+
+  CacheManager::~CacheManager()
+  {
+    // Persist the recency of the latest hits for the next start
+    try
+    {
+      std::auto_ptr<Orthanc::SQLite::Transaction> transaction(new Orthanc::SQLite::Transaction(pimpl_->db_));
+      transaction->Begin();
+      FlushAccessLog();
+      transaction->Commit();
+    }
+    catch (...)
+    {
+      OrthancPluginLogError(pimpl_->context_, "Cannot write back the LRU order of the Web viewer cache");
+    }
   }
 
 
@@ -304,14 +774,176 @@ namespace OrthancPlugins
   }
 
 
+  void CacheManager::SetReaper(CacheReaper& reaper)
+  {
+    pimpl_->reaper_ = &reaper;
+  }
+
+
+  void CacheManager::SetSegmentStorage(SegmentStorage& segments)
+  {
+    pimpl_->segments_ = &segments;
+    RecoverSegments();
+    SanityCheck();
+  }
+
+
+  void CacheManager::SetSegmentStorageEnabled(int bundle,
+                                              bool enabled)
+  {
+    if (enabled)
+    {
+      pimpl_->segmentBundles_.insert(bundle);
+    }
+    else
+    {
+      pimpl_->segmentBundles_.erase(bundle);
+    }
+  }
+
+
+  bool CacheManager::PrepareCompaction(std::vector<CompactionItem>& items)
+  {
+    items.clear();
+
+    if (pimpl_->segments_ == NULL)
+    {
+      return false;
+    }
+
+    SegmentStorage& segments = *pimpl_->segments_;
+
+    // The segments whose items were all evicted or moved are not
+    // candidates for the compaction: delete them first
+    segments.RemoveDeadSegments();
+
+    uint32_t segment;
+    if (!segments.LookupCompactionCandidate(segment))
+    {
+      return false;
+    }
+
+    uint64_t size = 0;
+
+    // The addresses of the items of the segment share the same prefix
+    const std::string prefix = SegmentStorage::GetAddressPrefix(segment);
+
+    for (PImpl::SegmentItems::const_iterator it = pimpl_->segmentItems_.lower_bound(prefix);
+         it != pimpl_->segmentItems_.end() && boost::starts_with(it->first, prefix) &&
+           items.size() < COMPACTION_BATCH_SIZE; ++it)
+    {
+      const IndexEntry* entry = LookupIndex(it->second.first, it->second.second);
+      assert(entry != NULL);
+
+      if (!items.empty() &&
+          size + entry->size_ > COMPACTION_BATCH_BYTES)
+      {
+        // Always move at least one item, even if it is large
+        return true;
+      }
+
+      CompactionItem item;
+      item.bundle_ = it->second.first;
+      item.item_ = it->second.second;
+      item.address_ = it->first;
+      items.push_back(item);
+
+      size += entry->size_;
+    }
+
+    return !items.empty();
+  }
+
+
+  void CacheManager::CommitCompaction(const std::vector<CompactionItem>& items,
+                                      const std::vector<std::string>& contents)
+  {
+    using namespace Orthanc;
+
+    assert(items.size() == contents.size());
+
+    if (pimpl_->segments_ == NULL)
+    {
+      return;
+    }
+
+    SegmentStorage& segments = *pimpl_->segments_;
+
+    // The items that are still at the address they were read from
+    std::vector<IndexEntry*> moved;
+    moved.reserve(items.size());
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+      IndexEntry* entry = LookupIndex(items[i].bundle_, items[i].item_);
+      moved.push_back(entry != NULL && entry->uuid_ == items[i].address_ ? entry : NULL);
+    }
+
+    // Copy the live items at the end of the current segment
+    std::vector<std::string> addresses(items.size());
+
+    try
+    {
+      std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+      transaction->Begin();
+
+      for (size_t i = 0; i < items.size(); i++)
+      {
+        if (moved[i] != NULL)
+        {
+          const std::string& content = contents[i];
+          addresses[i] = segments.Append(content.size() ? &content[0] : NULL, content.size());
+
+          SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "UPDATE Cache SET fileUuid=? WHERE seq=?");
+          s.BindString(0, addresses[i]);
+          s.BindInt64(1, moved[i]->seq_);
+          s.Run();
+        }
+      }
+
+      transaction->Commit();
+    }
+    catch (...)
+    {
+      for (size_t i = 0; i < addresses.size(); i++)
+      {
+        if (!addresses[i].empty())
+        {
+          segments.Remove(addresses[i]);
+        }
+      }
+
+      throw;
+    }
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+      if (moved[i] != NULL)
+      {
+        segments.Remove(moved[i]->uuid_);
+        pimpl_->segmentItems_.erase(moved[i]->uuid_);
+        pimpl_->segmentItems_[addresses[i]] = std::make_pair(items[i].bundle_, items[i].item_);
+        moved[i]->uuid_ = addresses[i];
+      }
+    }
+
+    segments.RemoveDeadSegments();
+  }
+
+
   void CacheManager::Open()
   {
     if (!pimpl_->db_.DoesTableExist("Cache"))
     {
-      pimpl_->db_.Execute("CREATE TABLE Cache(seq INTEGER PRIMARY KEY, bundle INTEGER, item TEXT, fileUuid TEXT, fileSize INT);");
+      pimpl_->db_.Execute("CREATE TABLE Cache(seq INTEGER PRIMARY KEY, bundle INTEGER, item TEXT, fileUuid TEXT, fileSize INT, cost INT);");
       pimpl_->db_.Execute("CREATE INDEX CacheBundles ON Cache(bundle);");
       pimpl_->db_.Execute("CREATE INDEX CacheIndex ON Cache(bundle, item);");
     }
+    else if (!pimpl_->db_.DoesColumnExist("Cache", "cost"))
+    {
+      // Cache created by a former version of the plugin
+      pimpl_->db_.Execute("ALTER TABLE Cache ADD COLUMN cost INT DEFAULT 0;");
+    }
 
     if (!pimpl_->db_.DoesTableExist("CacheProperties"))
     {
@@ -326,21 +958,78 @@ namespace OrthancPlugins
   }
 
 
-  void CacheManager::Store(int bundleIndex,
-                           const std::string& item,
-                           const std::string& content)
+  void CacheManager::GetMostRecentItems(std::vector<std::string>& items,
+                                        int bundleIndex,
+                                        uint64_t maxSpace)
   {
-    SanityCheck();
+    using namespace Orthanc;
 
-    const BundleQuota quota = GetBundleQuota(bundleIndex);
+    items.clear();
 
-    if (quota.GetMaxSpace() > 0 &&
-        content.size() > quota.GetMaxSpace())
+    PImpl::Index::const_iterator bundle = pimpl_->index_.find(bundleIndex);
+    if (bundle == pimpl_->index_.end())
     {
-      // Cannot store such a large instance into the cache, forget about it
       return;
     }
 
+    // The recency of the pending hits must be written to the sequence
+    {
+      std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+      transaction->Begin();
+      FlushAccessLog();
+      transaction->Commit();
+    }
+
+    typedef std::pair<int64_t, const PImpl::ItemIndex::value_type*>  Candidate;
+    std::vector<Candidate> candidates;
+    candidates.reserve(bundle->second.items_.size());
+
+    for (PImpl::ItemIndex::const_iterator it = bundle->second.items_.begin(); it != bundle->second.items_.end(); ++it)
+    {
+      candidates.push_back(std::make_pair(it->second.seq_, &(*it)));
+    }
+
+    std::sort(candidates.begin(), candidates.end(), std::greater<Candidate>());
+
+    uint64_t space = 0;
+    for (size_t i = 0; i < candidates.size(); i++)
+    {
+      space += candidates[i].second->second.size_;
+      if (space > maxSpace)
+      {
+        break;
+      }
+
+      items.push_back(candidates[i].second->first);
+    }
+  }
+
+
+  void CacheManager::Store(int bundleIndex,
+                           const std::string& item,
+                           const std::string& content,
+                           uint32_t cost)
+  {
+    std::vector<std::string> items(1, item);
+    std::vector<const std::string*> contents(1, &content);
+    std::vector<uint32_t> costs(1, cost);
+
+    StoreBatch(bundleIndex, items, contents, costs);
+  }
+
+
+  void CacheManager::StoreBatch(int bundleIndex,
+                                const std::vector<std::string>& items,
+                                const std::vector<const std::string*>& contents,
+                                const std::vector<uint32_t>& costs)
+  {
+    assert(items.size() == contents.size() &&
+           items.size() == costs.size());
+
+    SanityCheck();
+
+    const BundleQuota quota = GetBundleQuota(bundleIndex);
+
     using namespace Orthanc;
 
     std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
@@ -348,65 +1037,123 @@ namespace OrthancPlugins
 
     Bundle bundle = GetBundle(bundleIndex);
 
+    // The eviction is not done here, but by EnsureQuotas() that is
+    // called from a background thread
     std::list<std::string>  toRemove;
-    bundle.Add(content.size());
-    MakeRoom(bundle, toRemove, bundleIndex, quota);
+    std::list<std::string>  created;
+    std::set<std::string>   replaced;
 
-    // Store the cached content on the disk
-    const char* data = content.size() ? &content[0] : NULL;
-    std::string uuid = Toolbox::GenerateUuid();
-    pimpl_->storage_.Create(uuid, data, content.size(), Orthanc::FileContentType_Unknown);
+    typedef std::pair<const std::string*, IndexEntry>  Stored;
+    std::vector<Stored> stored;
+    stored.reserve(items.size());
 
     bool ok = true;
 
-    // Remove the previous cached value. This might happen if the same
-    // item is accessed very quickly twice: Another factory could have
-    // been cached a value before the check for existence in Access().
+    for (size_t i = 0; ok && i < items.size(); i++)
     {
-      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item=?");
-      s.BindInt(0, bundleIndex);
-      s.BindString(1, item);
-      if (s.Step())
+      const std::string& item = items[i];
+      const std::string& content = *contents[i];
+
+      if (quota.GetMaxSpace() > 0 &&
+          content.size() > quota.GetMaxSpace())
       {
-        SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-        t.BindInt64(0, s.ColumnInt64(0));
-        t.Run();
+        // Cannot store such a large instance into the cache, forget about it
+        continue;
+      }
 
-        toRemove.push_back(s.ColumnString(1));
-        bundle.Remove(s.ColumnInt64(2));
+      bundle.Add(content.size());
+
+      // Store the cached content on the disk
+      const char* data = content.size() ? &content[0] : NULL;
+      std::string uuid;
+
+      if (pimpl_->segments_ != NULL &&
+          pimpl_->segmentBundles_.find(bundleIndex) != pimpl_->segmentBundles_.end())
+      {
+        uuid = pimpl_->segments_->Append(data, content.size());
+      }
+      else
+      {
+        uuid = Toolbox::GenerateUuid();
+        pimpl_->storage_.Create(uuid, data, content.size(), Orthanc::FileContentType_Unknown);
       }
-    }
 
-    if (ok)
-    {
-      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "INSERT INTO Cache VALUES(NULL, ?, ?, ?, ?)");
-      s.BindInt(0, bundleIndex);
-      s.BindString(1, item);
-      s.BindString(2, uuid);
-      s.BindInt64(3, content.size());
+      created.push_back(uuid);
+
+      // Remove the previous cached value. This might happen if the same
+      // item is accessed very quickly twice: Another factory could have
+      // been cached a value before the check for existence in Access().
+      // The index is only updated once the transaction is committed.
+      if (replaced.find(item) == replaced.end())
+      {
+        const IndexEntry* previous = LookupIndex(bundleIndex, item);
+        if (previous != NULL)
+        {
+          SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
+          t.BindInt64(0, previous->seq_);
+          t.Run();
+
+          toRemove.push_back(previous->uuid_);
+          bundle.Remove(previous->size_);
+          replaced.insert(item);
+        }
+      }
+
+      // The seq comes from the clock of the hits, not from SQLite
+      const int64_t seq = ++pimpl_->clock_;
+
+      SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "INSERT INTO Cache(seq, bundle, item, fileUuid, fileSize, cost) VALUES(?, ?, ?, ?, ?, ?)");
+      s.BindInt64(0, seq);
+      s.BindInt(1, bundleIndex);
+      s.BindString(2, item);
+      s.BindString(3, uuid);
+      s.BindInt64(4, content.size());
+      s.BindInt(5, static_cast<int>(costs[i]));
 
       if (!s.Run())
       {
         ok = false;
       }
+      else
+      {
+        IndexEntry entry;
+        entry.seq_ = seq;
+        entry.uuid_ = uuid;
+        entry.size_ = content.size();
+        entry.cost_ = costs[i];
+        entry.hits_ = 1;
+        entry.logged_ = false;
+        UpdatePriority(bundleIndex, entry);
+
+        stored.push_back(std::make_pair(&item, entry));
+      }
     }
 
     if (!ok)
     {
-      // Error: Remove the stored file
-      pimpl_->storage_.Remove(uuid, Orthanc::FileContentType_Unknown);
+      // Error: Remove the stored files. The in-memory index was not
+      // modified yet, which preserves the hits and the priorities.
+      RemoveFiles(created);
+      transaction->Rollback();
     }
     else
     {
       transaction->Commit();
 
-      pimpl_->bundles_[bundleIndex] = bundle;
-    
-      for (std::list<std::string>::const_iterator
-             it = toRemove.begin(); it != toRemove.end(); it++)
+      for (std::set<std::string>::const_iterator
+             it = replaced.begin(); it != replaced.end(); ++it)
       {
-        pimpl_->storage_.Remove(*it, Orthanc::FileContentType_Unknown);
+        RemoveFromIndex(bundleIndex, *it);
       }
+
+      for (size_t i = 0; i < stored.size(); i++)
+      {
+        AddToIndex(bundleIndex, *stored[i].first, stored[i].second);
+      }
+
+      pimpl_->bundles_[bundleIndex] = bundle;
+
+      RemoveFiles(toRemove);
     }
 
     SanityCheck();
@@ -417,45 +1164,42 @@ namespace OrthancPlugins
   bool CacheManager::LocateInCache(std::string& uuid,
                                    uint64_t& size,
                                    int bundle,
-                                   const std::string& item)
+                                   const std::string& item,
+                                   bool touch)
   {
     using namespace Orthanc;
     SanityCheck();
 
-    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
-    transaction->Begin();
-
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item=?");
-    s.BindInt(0, bundle);
-    s.BindString(1, item);
-    if (!s.Step())
+    IndexEntry* entry = LookupIndex(bundle, item);
+    if (entry == NULL)
     {
       return false;
     }
 
-    int64_t seq = s.ColumnInt64(0);
-    uuid = s.ColumnString(1);
-    size = s.ColumnInt64(2);
+    uuid = entry->uuid_;
+    size = entry->size_;
 
-    // Touch the cache to fulfill the LRU scheme.
-    SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-    t.BindInt64(0, seq);
-    if (t.Run())
+    if (!touch)
     {
-      SQLite::Statement u(pimpl_->db_, SQLITE_FROM_HERE, "INSERT INTO Cache VALUES(NULL, ?, ?, ?, ?)");
-      u.BindInt(0, bundle);
-      u.BindString(1, item);
-      u.BindString(2, uuid);
-      u.BindInt64(3, size);
-      if (u.Run())
-      {
-        // Everything was OK. Commit the changes to the cache.
-        transaction->Commit();
-        return true;
-      }
+      return true;
     }
 
-    return false;
+    // Touch the cache to fulfill the LRU scheme. This is only recorded in
+    // memory, so that a hit does not involve SQLite at all.
+    LogAccess(*entry);
+
+    entry->hits_ += 1;
+    UpdatePriority(bundle, *entry);
+
+    if (pimpl_->accessLog_.size() >= ACCESS_LOG_FLUSH_SIZE)
+    {
+      std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+      transaction->Begin();
+      FlushAccessLog();
+      transaction->Commit();
+    }
+
+    return true;
   }
 
 
@@ -464,7 +1208,16 @@ namespace OrthancPlugins
   {
     std::string uuid;
     uint64_t size;
-    return LocateInCache(uuid, size, bundle, item);
+    return LocateInCache(uuid, size, bundle, item, false);
+  }
+
+
+  bool CacheManager::Locate(std::string& uuid,
+                            uint64_t& size,
+                            int bundle,
+                            const std::string& item)
+  {
+    return LocateInCache(uuid, size, bundle, item, true);
   }
 
 
@@ -474,7 +1227,7 @@ namespace OrthancPlugins
   {
     std::string uuid;
     uint64_t size;
-    if (!LocateInCache(uuid, size, bundle, item))
+    if (!LocateInCache(uuid, size, bundle, item, true))
     {
       return false;
     }
@@ -482,7 +1235,15 @@ namespace OrthancPlugins
     bool ok;
     try
     {
-      pimpl_->storage_.Read(content, uuid, Orthanc::FileContentType_Unknown);
+      if (SegmentStorage::IsSegmentAddress(uuid) &&
+          pimpl_->segments_ != NULL)
+      {
+        pimpl_->segments_->Read(content, uuid);
+      }
+      else
+      {
+        pimpl_->storage_.Read(content, uuid, Orthanc::FileContentType_Unknown);
+      }
       ok = (content.size() == size);
     }
     catch (std::runtime_error&)
@@ -507,54 +1268,116 @@ namespace OrthancPlugins
     using namespace Orthanc;
     SanityCheck();
 
-    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
-    transaction->Begin();
+    PImpl::Index::const_iterator index = pimpl_->index_.find(bundleIndex);
+    if (index == pimpl_->index_.end())
+    {
+      return;
+    }
+
+    // Range scan over the sorted keys of the bundle
+    std::list<std::string> items;
+    for (std::set<std::string>::const_iterator it = index->second.sorted_.lower_bound(itemPrefix);
+         it != index->second.sorted_.end() && boost::starts_with(*it, itemPrefix); ++it)
+    {
+      items.push_back(*it);
+    }
+
+    if (items.empty())
+    {
+      // Nothing cached for this prefix, which is the usual case for the
+      // instances that are just being received: SQLite is not involved
+      return;
+    }
 
     Bundle bundle = GetBundle(bundleIndex);
+    std::list<std::string> toRemove;
 
-    SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT seq, fileUuid, fileSize FROM Cache WHERE bundle=? AND item LIKE ?");
-    s.BindInt(0, bundleIndex);
-    s.BindString(1, itemPrefix + "%%");  // add a '%' after because we want to search on a prefix
-    while (s.Step())
+    std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+    transaction->Begin();
+
+    for (std::list<std::string>::const_iterator it = items.begin(); it != items.end(); ++it)
     {
-      int64_t seq = s.ColumnInt64(0);
-      const std::string uuid = s.ColumnString(1);
-      uint64_t expectedSize = s.ColumnInt64(2);
-      bundle.Remove(expectedSize);
+      const IndexEntry* entry = LookupIndex(bundleIndex, *it);
+      assert(entry != NULL);
 
       SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE seq=?");
-      t.BindInt64(0, seq);
-      if (t.Run())
-      {
-        pimpl_->bundles_[bundleIndex] = bundle;
-        pimpl_->storage_.Remove(uuid, Orthanc::FileContentType_Unknown);
-      }
+      t.BindInt64(0, entry->seq_);
+      t.Run();
+
+      toRemove.push_back(entry->uuid_);
+      bundle.Remove(entry->size_);
     }
+
     transaction->Commit();
+
+    for (std::list<std::string>::const_iterator it = items.begin(); it != items.end(); ++it)
+    {
+      RemoveFromIndex(bundleIndex, *it);
+    }
+
+    pimpl_->bundles_[bundleIndex] = bundle;
+
+    RemoveFiles(toRemove);
+
+    SanityCheck();
   }
 
 
 
   void CacheManager::SetBundleQuota(int bundle,
                                     uint32_t maxCount,
-                                    uint64_t maxSpace)
+                                    uint64_t maxSpace,
+                                    CacheEvictionPolicy policy)
   {
     SanityCheck();
 
-    const BundleQuota quota(maxCount, maxSpace);
+    const BundleQuota quota(maxCount, maxSpace, policy);
     EnsureQuota(bundle, quota);
     pimpl_->quotas_[bundle] = quota;
 
     SanityCheck();
   }
 
+  bool CacheManager::IsQuotaExceeded() const
+  {
+    for (Bundles::const_iterator it = pimpl_->bundles_.begin();
+         it != pimpl_->bundles_.end(); ++it)
+    {
+      if (!GetBundleQuota(it->first).IsSatisfied(it->second))
+      {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
+  void CacheManager::EnsureQuotas()
+  {
+    SanityCheck();
+
+    for (Bundles::const_iterator it = pimpl_->bundles_.begin();
+         it != pimpl_->bundles_.end(); ++it)
+    {
+      const BundleQuota& quota = GetBundleQuota(it->first);
+      if (!quota.IsSatisfied(it->second))
+      {
+        EnsureQuota(it->first, quota);
+      }
+    }
+
+    SanityCheck();
+  }
+
+
   void CacheManager::SetDefaultQuota(uint32_t maxCount,
                                      uint64_t maxSpace)
   {
     using namespace Orthanc;
     SanityCheck();
 
-    pimpl_->defaultQuota_ = BundleQuota(maxCount, maxSpace);
+    pimpl_->defaultQuota_ = BundleQuota(maxCount, maxSpace, CacheEvictionPolicy_LeastRecentlyUsed);
 
     SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT DISTINCT bundle FROM Cache");
     while (s.Step())
@@ -571,16 +1394,19 @@ namespace OrthancPlugins
     using namespace Orthanc;
     SanityCheck();
 
+    std::list<std::string> toRemove;
+
     SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT fileUuid FROM Cache");
     while (s.Step())
     {
-      pimpl_->storage_.Remove(s.ColumnString(0), Orthanc::FileContentType_Unknown);
+      toRemove.push_back(s.ColumnString(0));
     }  
 
     SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache");
     t.Run();
 
-    ReadBundleStatistics();
+    ReadIndex();
+    ReleaseFiles(toRemove);
     SanityCheck();
   }
 
@@ -591,18 +1417,29 @@ namespace OrthancPlugins
     using namespace Orthanc;
     SanityCheck();
 
+    {
+      // Write back the pending hits, as the index is reloaded below
+      std::auto_ptr<SQLite::Transaction> transaction(new SQLite::Transaction(pimpl_->db_));
+      transaction->Begin();
+      FlushAccessLog();
+      transaction->Commit();
+    }
+
+    std::list<std::string> toRemove;
+
     SQLite::Statement s(pimpl_->db_, SQLITE_FROM_HERE, "SELECT fileUuid FROM Cache WHERE bundle=?");
     s.BindInt(0, bundle);
     while (s.Step())
     {
-      pimpl_->storage_.Remove(s.ColumnString(0), Orthanc::FileContentType_Unknown);
+      toRemove.push_back(s.ColumnString(0));
     }  
 
     SQLite::Statement t(pimpl_->db_, SQLITE_FROM_HERE, "DELETE FROM Cache WHERE bundle=?");
     t.BindInt(0, bundle);
     t.Run();
 
-    ReadBundleStatistics();
+    ReadIndex();
+    ReleaseFiles(toRemove);
     SanityCheck();
   }
 
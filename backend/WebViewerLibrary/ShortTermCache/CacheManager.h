@@ -26,8 +26,13 @@
 
 #include <orthanc/OrthancCPlugin.h>
 
+#include <vector>
+
 namespace OrthancPlugins
 {
+  class CacheReaper;
+  class SegmentStorage;
+
   enum CacheProperty
   {
     CacheProperty_OrthancVersion,
@@ -35,6 +40,19 @@ namespace OrthancPlugins
   };
 
 
+  enum CacheEvictionPolicy
+  {
+    // Evicts the least recently used items first
+    CacheEvictionPolicy_LeastRecentlyUsed,
+
+    // GreedyDual-Size-Frequency: evicts first the items that are cheap to
+    // create, large and rarely hit. The items that were never hit age
+    // through an inflation value, so that expensive items cannot stay
+    // forever once they are not used anymore.
+    CacheEvictionPolicy_GreedyDualSizeFrequency
+  };
+
+
   class CacheManager : public boost::noncopyable
   {
   private:
@@ -43,6 +61,7 @@ namespace OrthancPlugins
 
     class Bundle;
     class BundleQuota;
+    struct IndexEntry;
 
     typedef std::map<int, Bundle>  Bundles;
     typedef std::map<int, BundleQuota>  BundleQuotas;
@@ -51,6 +70,14 @@ namespace OrthancPlugins
 
     Bundle GetBundle(int bundleIndex) const;
 
+    void UpdatePriority(int bundleIndex,
+                        IndexEntry& entry);
+
+    void MakeRoomByCost(Bundle& bundle,
+                        std::list<std::string>& toRemove,
+                        int bundleIndex,
+                        const BundleQuota& quota);
+
     void MakeRoom(Bundle& bundle,
                   std::list<std::string>& toRemove,
                   int bundleIndex,
@@ -59,14 +86,41 @@ namespace OrthancPlugins
     void EnsureQuota(int bundleIndex,
                      const BundleQuota& quota);
 
-    void ReadBundleStatistics();
+    void ReadIndex();
+
+    IndexEntry* LookupIndex(int bundleIndex,
+                            const std::string& item);
+
+    bool AddToIndex(int bundleIndex,
+                    const std::string& item,
+                    const IndexEntry& entry);
+
+    void RemoveFromIndex(int bundleIndex,
+                         const std::string& item);
 
     void Open();
 
+    // Only the reads touch the item: the probes must not change its
+    // recency, nor its priority for the eviction
     bool LocateInCache(std::string& uuid,
                        uint64_t& size,
                        int bundle,
-                       const std::string& item);
+                       const std::string& item,
+                       bool touch);
+
+    void LogAccess(IndexEntry& entry);
+
+    void ForgetAccess(IndexEntry& entry);
+
+    void FlushAccessLog();
+
+    void RemoveFile(const std::string& uuid);
+
+    void RemoveFiles(const std::list<std::string>& uuids);
+
+    void ReleaseFiles(const std::list<std::string>& uuids);
+
+    void RecoverSegments();
 
     void SanityCheck();  // Only for debug
 
@@ -76,24 +130,73 @@ namespace OrthancPlugins
                  Orthanc::SQLite::Connection& db,
                  Orthanc::FilesystemStorage& storage);
 
+    ~CacheManager();
+
     OrthancPluginContext* GetPluginContext() const;
 
     void SetSanityCheckEnabled(bool enabled);
 
+    // Delegates the removal of the files to a background thread (by
+    // default, they are removed synchronously)
+    void SetReaper(CacheReaper& reaper);
+
+    // Checks the items that are stored in the segments, and drops the
+    // ones that did not survive the last shutdown
+    void SetSegmentStorage(SegmentStorage& segments);
+
+    // Whether the new items of this bundle are appended to the segment
+    // storage (if any), instead of being written to their own file
+    void SetSegmentStorageEnabled(int bundle,
+                                  bool enabled);
+
+    // Live item of a fragmented segment, that is moved by the compaction
+    struct CompactionItem
+    {
+      int          bundle_;
+      std::string  item_;
+      std::string  address_;
+    };
+
+    // Lists some of the live items of the most fragmented segment, meant
+    // to be called periodically. They all belong to the same segment,
+    // whose content can then be read without locking the cache.
+    bool PrepareCompaction(std::vector<CompactionItem>& items);
+
+    // Appends the contents read from the listed items to the current
+    // segment. The items that were removed or replaced meanwhile are
+    // skipped.
+    void CommitCompaction(const std::vector<CompactionItem>& items,
+                          const std::vector<std::string>& contents);
+
     void Clear();
 
     void Clear(int bundle);
 
     void SetBundleQuota(int bundle,
                         uint32_t maxCount,
-                        uint64_t maxSpace);
+                        uint64_t maxSpace,
+                        CacheEvictionPolicy policy = CacheEvictionPolicy_LeastRecentlyUsed);
 
     void SetDefaultQuota(uint32_t maxCount,
                          uint64_t maxSpace);
 
+    // Store() lets the bundles grow above their quota: the eviction is
+    // batched by this method, that is meant to be called periodically
+    bool IsQuotaExceeded() const;
+
+    void EnsureQuotas();
+
+    // Does not count as a hit
     bool IsCached(int bundle,
                   const std::string& item);
 
+    // Same as Access(), but gives the location of the item instead of
+    // reading it
+    bool Locate(std::string& uuid,
+                uint64_t& size,
+                int bundle,
+                const std::string& item);
+
     bool Access(std::string& content,
                 int bundle,
                 const std::string& item);
@@ -101,9 +204,25 @@ namespace OrthancPlugins
     void Invalidate(int bundle,
                     const std::string& itemPrefix);
 
+    // Lists the most recently used items of the bundle, most recent
+    // first, until their total size reaches "maxSpace"
+    void GetMostRecentItems(std::vector<std::string>& items,
+                            int bundle,
+                            uint64_t maxSpace);
+
+    // The cost is the time (in milliseconds) that was needed to create
+    // the content, it is only used by the cost-aware eviction policy
     void Store(int bundle,
                const std::string& item,
-               const std::string& content);
+               const std::string& content,
+               uint32_t cost);
+
+    // Stores several items of the same bundle in one transaction. The
+    // items must be distinct.
+    void StoreBatch(int bundle,
+                    const std::vector<std::string>& items,
+                    const std::vector<const std::string*>& contents,
+                    const std::vector<uint32_t>& costs);
 
     void SetProperty(CacheProperty property,
                      const std::string& value);
@@ -0,0 +1,188 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "CacheReaper.h"
+
+
+namespace OrthancPlugins
+{
+  class CacheReaper::Job : public Orthanc::IDynamicObject
+  {
+  private:
+    Orthanc::FilesystemStorage*  storage_;   // NULL if "target_" is a path
+    std::string                  target_;
+
+  public:
+    Job(Orthanc::FilesystemStorage* storage,
+        const std::string& target) :
+      storage_(storage),
+      target_(target)
+    {
+    }
+
+    void Execute()
+    {
+      if (storage_ != NULL)
+      {
+        storage_->Remove(target_, Orthanc::FileContentType_Unknown);
+      }
+      else
+      {
+        boost::filesystem::remove(target_);
+      }
+    }
+  };
+
+
+  CacheReaper::Pin::Pin(CacheReaper& reaper,
+                        const std::string& key) :
+    reaper_(reaper),
+    key_(key)
+  {
+    boost::mutex::scoped_lock lock(reaper_.pinsMutex_);
+    reaper_.pins_[key_] += 1;
+  }
+
+
+  CacheReaper::Pin::~Pin()
+  {
+    reaper_.Unpin(key_);
+  }
+
+
+  void CacheReaper::Worker(CacheReaper* that)
+  {
+    for (;;)
+    {
+      std::auto_ptr<Orthanc::IDynamicObject> job(that->queue_.Dequeue(100));
+
+      if (job.get() == NULL)
+      {
+        if (that->done_)
+        {
+          // The queue is drained
+          return;
+        }
+      }
+      else
+      {
+        try
+        {
+          dynamic_cast<Job&>(*job).Execute();
+        }
+        catch (...)
+        {
+          OrthancPluginLogWarning(that->context_, "Cannot remove a file from the cache of the Web viewer");
+        }
+      }
+    }
+  }
+
+
+  void CacheReaper::Schedule(const std::string& key,
+                             Job* job)
+  {
+    std::auto_ptr<Job> protection(job);
+
+    {
+      boost::mutex::scoped_lock lock(pinsMutex_);
+
+      if (pins_.find(key) != pins_.end())
+      {
+        // The file is still mapped, it will be removed by Unpin()
+        delete deferred_[key];
+        deferred_[key] = protection.release();
+        return;
+      }
+    }
+
+    queue_.Enqueue(protection.release());
+  }
+
+
+  void CacheReaper::Unpin(const std::string& key)
+  {
+    std::auto_ptr<Job> job;
+
+    {
+      boost::mutex::scoped_lock lock(pinsMutex_);
+
+      PinCounts::iterator pin = pins_.find(key);
+      if (pin == pins_.end() ||
+          --(pin->second) > 0)
+      {
+        return;
+      }
+
+      pins_.erase(pin);
+
+      DeferredJobs::iterator deferred = deferred_.find(key);
+      if (deferred != deferred_.end())
+      {
+        job.reset(deferred->second);
+        deferred_.erase(deferred);
+      }
+    }
+
+    if (job.get() != NULL)
+    {
+      queue_.Enqueue(job.release());
+    }
+  }
+
+
+  CacheReaper::CacheReaper(OrthancPluginContext* context) :
+    context_(context),
+    done_(false)
+  {
+    thread_ = boost::thread(Worker, this);
+  }
+
+
+  CacheReaper::~CacheReaper()
+  {
+    done_ = true;
+    if (thread_.joinable())
+    {
+      thread_.join();
+    }
+
+    // Should not happen, as the pins are released before the cache is
+    // closed. Do not remove these files, their mapping might still exist.
+    for (DeferredJobs::iterator it = deferred_.begin(); it != deferred_.end(); ++it)
+    {
+      delete it->second;
+    }
+  }
+
+
+  void CacheReaper::Remove(Orthanc::FilesystemStorage& storage,
+                           const std::string& uuid)
+  {
+    Schedule(uuid, new Job(&storage, uuid));
+  }
+
+
+  void CacheReaper::RemovePath(const boost::filesystem::path& path)
+  {
+    Schedule(path.string(), new Job(NULL, path.string()));
+  }
+}
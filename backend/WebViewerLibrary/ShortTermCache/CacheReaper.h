@@ -0,0 +1,96 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "Core/FileStorage/FilesystemStorage.h"
+#include "Core/MultiThreading/SharedMessageQueue.h"
+
+#include <orthanc/OrthancCPlugin.h>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include <map>
+
+namespace OrthancPlugins
+{
+  // Background thread that deletes the files of the evicted or
+  // invalidated cache entries, so that the callers do not hold the lock
+  // of the cache while the filesystem works. The entries are removed from
+  // the index before their file is queued here, and the UUIDs are never
+  // reused, so a late removal is harmless.
+  //
+  // A file can be pinned while it is mapped in memory: its removal is
+  // then deferred until the last pin is released.
+  class CacheReaper : public boost::noncopyable
+  {
+  public:
+    class Pin : public boost::noncopyable
+    {
+    private:
+      CacheReaper&  reaper_;
+      std::string   key_;
+
+    public:
+      // The key is either the UUID of a file of a FilesystemStorage, or
+      // the path of a file removed through RemovePath()
+      Pin(CacheReaper& reaper,
+          const std::string& key);
+
+      ~Pin();
+    };
+
+  private:
+    class Job;
+
+    typedef std::map<std::string, unsigned int>  PinCounts;
+    typedef std::map<std::string, Job*>          DeferredJobs;
+
+    OrthancPluginContext*        context_;
+    Orthanc::SharedMessageQueue  queue_;
+    bool                         done_;
+    boost::thread                thread_;
+
+    boost::mutex                 pinsMutex_;
+    PinCounts                    pins_;
+    DeferredJobs                 deferred_;
+
+    static void Worker(CacheReaper* that);
+
+    void Schedule(const std::string& key,
+                  Job* job);
+
+    void Unpin(const std::string& key);
+
+  public:
+    explicit CacheReaper(OrthancPluginContext* context);
+
+    // Waits for all the pending files to be removed. All the pins must
+    // have been released.
+    ~CacheReaper();
+
+    // The storage must outlive this object
+    void Remove(Orthanc::FilesystemStorage& storage,
+                const std::string& uuid);
+
+    void RemovePath(const boost::filesystem::path& path);
+  };
+}
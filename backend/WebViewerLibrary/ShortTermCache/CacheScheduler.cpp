@@ -25,415 +25,1973 @@
 
 #include "Core/OrthancException.h"
 #include <stdio.h>
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <memory>
+#include <set>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
 #include "ShortTermCache/CacheContext.h"
 
+// Number of accesses whose prefetch policy can be pending: the oldest
+// ones are dropped, as their prefetches are superseded by the new ones
+static const size_t MAX_PENDING_POLICIES = 100;
+
+// Number of groups (i.e. series) whose prefetch generations are
+// tracked: the pending prefetches of the least recently active ones are
+// cancelled beyond this number
+static const size_t MAX_PREFETCH_GROUPS = 1000;
+
+// The prefetch policies are applied before the prefetches of the bundles
+static const unsigned int POLICY_WEIGHT = 8;
+
 namespace OrthancPlugins
 {
-  class DynamicString : public Orthanc::IDynamicObject
+  // Cost of the creation of an item by its factory, as recorded by the
+  // cache for its eviction policy
+  static uint32_t GetCreationCost(const boost::posix_time::ptime& start)
+  {
+    const boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+    return static_cast<uint32_t>(std::max<int64_t>(1, elapsed.total_milliseconds()));
+  }
+
+  // Item to be prefetched. The group (e.g. the series) and the generation
+  // of the request allow to cancel or postpone the superseded requests.
+  struct PrefetchRequest
+  {
+    std::string  item_;
+    std::string  group_;
+    uint64_t     generation_;
+  };
+
+
+  // Pending prefetches of a bundle. The items are dequeued by increasing
+  // quality rank (the fastest qualities first), then by increasing
+  // distance to the slice that is displayed, then from the most recently
+  // requested one. The background requests come after the other ones,
+  // and the requests of a superseded generation, or of a group that the
+  // user has left, after all the others.
+  // Requesting a pending item again updates its priority, but does not
+  // move it to the background.
+  //
+  // The ranges of slices are expanded lazily: only the next item of each
+  // range is in the priority queue, and it is replaced by the following
+  // one once dequeued. A range does not update the priority of the items
+  // that are pending individually or in other ranges.
+  class CacheScheduler::PrefetchQueue : public boost::noncopyable
+  {
+  private:
+    struct Priority
+    {
+      bool          superseded_;
+      bool          background_;
+      unsigned int  qualityRank_;
+      unsigned int  distance_;
+      uint64_t      stamp_;   // Increases at each request
+
+      bool operator< (const Priority& other) const
+      {
+        if (superseded_ != other.superseded_)
+        {
+          return !superseded_;
+        }
+        else if (background_ != other.background_)
+        {
+          return !background_;
+        }
+        else if (qualityRank_ != other.qualityRank_)
+        {
+          return qualityRank_ < other.qualityRank_;
+        }
+        else if (distance_ != other.distance_)
+        {
+          return distance_ < other.distance_;
+        }
+        else
+        {
+          return stamp_ > other.stamp_;
+        }
+      }
+    };
+
+    struct Pending
+    {
+      Priority     priority_;
+      std::string  group_;
+      uint64_t     generation_;
+    };
+
+    // The slices are walked around the position, the previous slice
+    // first at each distance: step 0 is the position, then the steps
+    // (2d - 1) and 2d are the slices at distance d before and after it.
+    class PendingRange : public boost::noncopyable
+    {
+    private:
+      PrefetchRange      range_;
+      uint64_t           generation_;
+      Priority           priority_;
+      size_t             quality_;
+      size_t             step_;
+      size_t             lastStep_;
+      std::vector<bool>  taken_;
+
+      size_t GetIndex(size_t slice,
+                      size_t quality) const
+      {
+        return (slice - range_.GetBegin()) * range_.GetQualities().size() + quality;
+      }
+
+      bool LookupSlice(size_t& slice,
+                       size_t step) const
+      {
+        const size_t distance = (step + 1) / 2;
+        const bool previous = ((step % 2 == 1) != range_.IsForwardFirst());
+
+        if (step == 0)
+        {
+          slice = range_.GetPosition();
+        }
+        else if (previous)
+        {
+          if (range_.GetPosition() < distance)
+          {
+            return false;
+          }
+
+          slice = range_.GetPosition() - distance;
+        }
+        else
+        {
+          slice = range_.GetPosition() + distance;
+        }
+
+        return (slice >= range_.GetBegin() &&
+                slice < range_.GetEnd());
+      }
+
+    public:
+      PendingRange(const PrefetchRange& range,
+                   uint64_t generation,
+                   uint64_t stamp) :
+        range_(range),
+        generation_(generation),
+        quality_(0),
+        step_(0),
+        taken_((range.GetEnd() - range.GetBegin()) * range.GetQualities().size(), false)
+      {
+        const size_t position = range.GetPosition();
+        const size_t before = (position > range.GetBegin() ? position - range.GetBegin() : 0);
+        const size_t after = (range.GetEnd() > position + 1 ? range.GetEnd() - position - 1 : 0);
+        lastStep_ = 2 * std::max(before, after);
+
+        priority_.superseded_ = false;
+        priority_.background_ = false;
+        priority_.qualityRank_ = 0;
+        priority_.distance_ = 0;
+        priority_.stamp_ = stamp;
+      }
+
+      const PrefetchRange& GetRange() const
+      {
+        return range_;
+      }
+
+      uint64_t GetGeneration() const
+      {
+        return generation_;
+      }
+
+      const Priority& GetPriority() const
+      {
+        return priority_;
+      }
+
+      void Supersede()
+      {
+        priority_.superseded_ = true;
+      }
+
+      // Moves to the first item that is not taken yet, starting at the
+      // current one. Returns "false" once the range is exhausted.
+      bool Seek()
+      {
+        while (quality_ < range_.GetQualities().size())
+        {
+          while (step_ <= lastStep_)
+          {
+            size_t slice;
+            if (LookupSlice(slice, step_) &&
+                !taken_[GetIndex(slice, quality_)])
+            {
+              priority_.qualityRank_ = static_cast<unsigned int>(quality_);
+              priority_.distance_ = static_cast<unsigned int>((step_ + 1) / 2);
+              return true;
+            }
+
+            step_++;
+          }
+
+          quality_++;
+          step_ = 0;
+        }
+
+        return false;
+      }
+
+      // Takes the current item, then moves to the next one
+      std::string Take()
+      {
+        size_t slice;
+        bool found = LookupSlice(slice, step_);
+        assert(found);
+
+        taken_[GetIndex(slice, quality_)] = true;
+        step_++;
+
+        return range_.GetItem(slice, quality_);
+      }
+
+      // Takes all the qualities of the slices whose item starts with
+      // "prefix" (i.e. "{slice}/")
+      void TakeBatch(std::vector<std::string>& items,
+                     const std::string& prefix)
+      {
+        const PrefetchRange::Slices& slices = range_.GetSlices();
+
+        for (size_t slice = range_.GetBegin(); slice < range_.GetEnd(); slice++)
+        {
+          if (prefix.size() == slices[slice].size() + 1 &&
+              boost::starts_with(prefix, slices[slice]) &&
+              prefix[prefix.size() - 1] == '/')
+          {
+            for (size_t quality = 0; quality < range_.GetQualities().size(); quality++)
+            {
+              if (!taken_[GetIndex(slice, quality)])
+              {
+                taken_[GetIndex(slice, quality)] = true;
+                items.push_back(range_.GetItem(slice, quality));
+              }
+            }
+          }
+        }
+      }
+    };
+
+    typedef std::map<Priority, std::string>     Queue;
+    typedef std::map<std::string, Pending>      Content;
+    typedef std::map<Priority, PendingRange*>   Ranges;  // Indexed by their next item
+
+    boost::mutex               mutex_;
+    size_t                     maxSize_;
+    uint64_t                   stamp_;
+    Queue                      queue_;
+    Content                    content_;
+    Ranges                     ranges_;
+
+    void EnqueueInternal(const std::string& item,
+                         unsigned int qualityRank,
+                         unsigned int distance,
+                         const std::string& group,
+                         uint64_t generation,
+                         bool background)
+    {
+      Pending pending;
+      pending.priority_.superseded_ = false;
+      pending.priority_.background_ = background;
+      pending.priority_.qualityRank_ = qualityRank;
+      pending.priority_.distance_ = distance;
+      pending.priority_.stamp_ = ++stamp_;
+      pending.group_ = group;
+      pending.generation_ = generation;
+
+      Content::iterator found = content_.find(item);
+      if (found != content_.end() &&
+          background &&
+          !found->second.priority_.background_ &&
+          !found->second.priority_.superseded_)
+      {
+        // This item is already requested with a higher priority
+        return;
+      }
+      else if (found != content_.end())
+      {
+        // This cache index is already pending in the queue, reprioritize it
+        queue_.erase(found->second.priority_);
+        found->second = pending;
+      }
+      else
+      {
+        if (maxSize_ != 0 &&
+            content_.size() >= maxSize_)
+        {
+          // The queue is full, drop the item with the lowest priority
+          Queue::iterator last = queue_.end();
+          --last;
+
+          if (pending.priority_ < last->first)
+          {
+            content_.erase(last->second);
+            queue_.erase(last);
+          }
+          else
+          {
+            return;
+          }
+        }
+
+        content_[item] = pending;
+      }
+
+      queue_[pending.priority_] = item;
+    }
+
+    void EnqueueInternal(const PrefetchRange& range,
+                         uint64_t generation)
+    {
+      std::auto_ptr<PendingRange> pending(new PendingRange(range, generation, ++stamp_));
+      if (!pending->Seek())
+      {
+        return;
+      }
+
+      if (maxSize_ != 0 &&
+          ranges_.size() >= maxSize_)
+      {
+        // Too many ranges, drop the one whose next item has the lowest priority
+        Ranges::iterator last = ranges_.end();
+        --last;
+
+        if (pending->GetPriority() < last->first)
+        {
+          delete last->second;
+          ranges_.erase(last);
+        }
+        else
+        {
+          return;
+        }
+      }
+
+      ranges_[pending->GetPriority()] = pending.get();
+      pending.release();
+    }
+
+  public:
+    PrefetchQueue(size_t maxSize) :
+      maxSize_(maxSize),
+      stamp_(0)
+    {
+    }
+
+    ~PrefetchQueue()
+    {
+      for (Ranges::iterator it = ranges_.begin(); it != ranges_.end(); ++it)
+      {
+        delete it->second;
+      }
+    }
+
+    void Enqueue(const std::string& item,
+                 unsigned int qualityRank,
+                 unsigned int distance,
+                 const std::string& group,
+                 uint64_t generation)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      EnqueueInternal(item, qualityRank, distance, group, generation, false);
+    }
+
+    // Enqueues a batch under a single lock. The items are enqueued in
+    // reverse order, so that the first listed ones are the most recent
+    // requests. "generations" gives the generation of each group.
+    void Enqueue(const std::vector<const CacheIndex*>& items,
+                 const std::vector<const PrefetchRange*>& ranges,
+                 const std::map<std::string, uint64_t>& generations)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (size_t i = ranges.size(); i > 0; i--)
+      {
+        const PrefetchRange& range = *ranges[i - 1];
+
+        std::map<std::string, uint64_t>::const_iterator generation = generations.find(range.GetGroup());
+        EnqueueInternal(range, (generation == generations.end() ? 0 : generation->second));
+      }
+
+      for (size_t i = items.size(); i > 0; i--)
+      {
+        const CacheIndex& item = *items[i - 1];
+
+        std::map<std::string, uint64_t>::const_iterator generation = generations.find(item.GetGroup());
+        EnqueueInternal(item.GetItem(), item.GetQualityRank(), item.GetDistance(), item.GetGroup(),
+                        (generation == generations.end() ? 0 : generation->second), item.IsBackground());
+      }
+    }
+
+    bool Dequeue(PrefetchRequest& request)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!ranges_.empty() &&
+          (queue_.empty() ||
+           ranges_.begin()->first < queue_.begin()->first))
+      {
+        // The next item of a range comes first
+        PendingRange* range = ranges_.begin()->second;
+        ranges_.erase(ranges_.begin());
+
+        request.item_ = range->Take();
+        request.group_ = range->GetRange().GetGroup();
+        request.generation_ = range->GetGeneration();
+
+        if (range->Seek())
+        {
+          ranges_[range->GetPriority()] = range;
+        }
+        else
+        {
+          delete range;
+        }
+
+        return true;
+      }
+
+      if (queue_.empty())
+      {
+        return false;
+      }
+
+      Content::iterator found = content_.find(queue_.begin()->second);
+      assert(found != content_.end());
+
+      request.item_ = found->first;
+      request.group_ = found->second.group_;
+      request.generation_ = found->second.generation_;
+
+      content_.erase(found);
+      queue_.erase(queue_.begin());
+
+      return true;
+    }
+
+    // Removes the pending items that start with "prefix", and appends
+    // them to "batch"
+    void TakeBatch(std::vector<PrefetchRequest>& batch,
+                   const std::string& prefix)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Content::iterator it = content_.lower_bound(prefix);
+      while (it != content_.end() &&
+             boost::starts_with(it->first, prefix))
+      {
+        PrefetchRequest request;
+        request.item_ = it->first;
+        request.group_ = it->second.group_;
+        request.generation_ = it->second.generation_;
+        batch.push_back(request);
+
+        queue_.erase(it->second.priority_);
+        content_.erase(it++);
+      }
+
+      std::vector<PendingRange*> ranges;
+      for (Ranges::const_iterator range = ranges_.begin(); range != ranges_.end(); ++range)
+      {
+        ranges.push_back(range->second);
+      }
+
+      for (size_t i = 0; i < ranges.size(); i++)
+      {
+        std::vector<std::string> items;
+        ranges[i]->TakeBatch(items, prefix);
+
+        if (!items.empty())
+        {
+          for (size_t j = 0; j < items.size(); j++)
+          {
+            PrefetchRequest request;
+            request.item_ = items[j];
+            request.group_ = ranges[i]->GetRange().GetGroup();
+            request.generation_ = ranges[i]->GetGeneration();
+            batch.push_back(request);
+          }
+
+          // The next item of the range might have been taken
+          ranges_.erase(ranges[i]->GetPriority());
+
+          if (ranges[i]->Seek())
+          {
+            ranges_[ranges[i]->GetPriority()] = ranges[i];
+          }
+          else
+          {
+            delete ranges[i];
+          }
+        }
+      }
+    }
+
+    // Postpones the requests of the group that are older than "generation"
+    void Supersede(const std::string& group,
+                   uint64_t generation)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (Content::iterator it = content_.begin(); it != content_.end(); ++it)
+      {
+        if (it->second.group_ == group &&
+            it->second.generation_ < generation &&
+            !it->second.priority_.superseded_)
+        {
+          queue_.erase(it->second.priority_);
+          it->second.priority_.superseded_ = true;
+          queue_[it->second.priority_] = it->first;
+        }
+      }
+
+      Ranges::iterator it = ranges_.begin();
+      while (it != ranges_.end() &&
+             !it->first.superseded_)
+      {
+        PendingRange* range = it->second;
+
+        if (range->GetRange().GetGroup() == group &&
+            range->GetGeneration() < generation)
+        {
+          // Moved after all the ranges that are not superseded
+          ranges_.erase(it++);
+          range->Supersede();
+          ranges_[range->GetPriority()] = range;
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+
+    // Postpones the requests of all the named groups that are not listed
+    void SupersedeOthers(const std::set<std::string>& groups)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (Content::iterator it = content_.begin(); it != content_.end(); ++it)
+      {
+        if (!it->second.group_.empty() &&
+            groups.find(it->second.group_) == groups.end() &&
+            !it->second.priority_.superseded_)
+        {
+          queue_.erase(it->second.priority_);
+          it->second.priority_.superseded_ = true;
+          queue_[it->second.priority_] = it->first;
+        }
+      }
+
+      Ranges::iterator it = ranges_.begin();
+      while (it != ranges_.end() &&
+             !it->first.superseded_)
+      {
+        PendingRange* range = it->second;
+        const std::string& group = range->GetRange().GetGroup();
+
+        if (!group.empty() &&
+            groups.find(group) == groups.end())
+        {
+          ranges_.erase(it++);
+          range->Supersede();
+          ranges_[range->GetPriority()] = range;
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+
+    void Cancel(const std::string& group)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Content::iterator it = content_.begin();
+      while (it != content_.end())
+      {
+        if (it->second.group_ == group)
+        {
+          queue_.erase(it->second.priority_);
+          content_.erase(it++);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+
+      Ranges::iterator range = ranges_.begin();
+      while (range != ranges_.end())
+      {
+        if (range->second->GetRange().GetGroup() == group)
+        {
+          delete range->second;
+          ranges_.erase(range++);
+        }
+        else
+        {
+          ++range;
+        }
+      }
+    }
+  };
+
+
+  // Pending creation of an item by the factory. The concurrent requests
+  // for the same item wait for its result, instead of creating the item
+  // once more.
+  class CacheScheduler::Flight : public boost::noncopyable
+  {
+  public:
+    enum State
+    {
+      State_Running,
+      State_Succeeded,
+      State_Failed,     // The factory cannot create this item
+      State_Aborted     // Exception or invalidation, the waiters must retry
+    };
+
+  private:
+    boost::mutex               mutex_;
+    boost::condition_variable  finished_;
+    State                      state_;
+    bool                       invalidated_;
+    unsigned int               waiters_;
+    MemoryCache::Content       content_;
+
+  public:
+    Flight() :
+      state_(State_Running),
+      invalidated_(false),
+      waiters_(0)
+    {
+    }
+
+    // Must be locked while the result is stored, so that an invalidation
+    // either happens before the item is stored, or after it
+    boost::mutex& GetMutex()
+    {
+      return mutex_;
+    }
+
+    // The mutex must be locked
+    bool IsInvalidated() const
+    {
+      return invalidated_;
+    }
+
+    // The mutex must be locked
+    bool HasWaiters() const
+    {
+      return waiters_ > 0;
+    }
+
+    void AddWaiter()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      waiters_++;
+    }
+
+    void Invalidate()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      invalidated_ = true;
+    }
+
+    void Finish(State state,
+                const MemoryCache::Content& content)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      state_ = state;
+      content_ = content;
+      finished_.notify_all();
+    }
+
+    State Wait(MemoryCache::Content& content)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (state_ == State_Running)
+      {
+        finished_.wait(lock);
+      }
+
+      content = content_;
+      return state_;
+    }
+  };
+
+
+  // Items of a bundle that are being created, either by a prefetcher or
+  // by a foreground request
+  class CacheScheduler::FlightTable : public boost::noncopyable
+  {
+  private:
+    typedef std::map<std::string, boost::shared_ptr<Flight> >  Flights;
+
+    boost::mutex  mutex_;
+    Flights       flights_;
+
+  public:
+    // Returns "true" if the caller must create the item, and then call
+    // Land(). Otherwise, the caller must wait for "flight".
+    bool Join(boost::shared_ptr<Flight>& flight,
+              const std::string& item)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Flights::const_iterator found = flights_.find(item);
+      if (found != flights_.end())
+      {
+        flight = found->second;
+        flight->AddWaiter();
+        return false;
+      }
+      else
+      {
+        flight.reset(new Flight);
+        flights_[item] = flight;
+        return true;
+      }
+    }
+
+    // Same as Join(), but does not wait for the item if it is already
+    // being created
+    bool TryStart(boost::shared_ptr<Flight>& flight,
+                  const std::string& item)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (flights_.find(item) != flights_.end())
+      {
+        return false;
+      }
+      else
+      {
+        flight.reset(new Flight);
+        flights_[item] = flight;
+        return true;
+      }
+    }
+
+    void Land(const std::string& item,
+              const boost::shared_ptr<Flight>& flight)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      // The flight is not registered anymore if it was invalidated
+      Flights::iterator found = flights_.find(item);
+      if (found != flights_.end() &&
+          found->second == flight)
+      {
+        flights_.erase(found);
+      }
+    }
+
+    void Invalidate(const std::string& itemPrefix)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Flights::iterator it = flights_.lower_bound(itemPrefix);
+      while (it != flights_.end() &&
+             boost::starts_with(it->first, itemPrefix))
+      {
+        it->second->Invalidate();
+        flights_.erase(it++);
+      }
+    }
+  };
+
+
+  // The prefetches of a bundle are run by the threads of the executor
+  // that is shared by all the bundles
+  class CacheScheduler::BundleScheduler : public CacheExecutor::IQueue
+  {
+  private:
+    CacheScheduler&                scheduler_;
+    int                            bundleIndex_;
+    std::auto_ptr<ICacheFactory>   factory_;
+    ShardedCacheManager&           cacheManager_;
+    MemoryCache&                   memoryCache_;
+    CacheLogger*                   cacheLogger_;
+    CacheExecutor&                 executor_;
+    PrefetchThrottle&              throttle_;
+    PrefetchQueue                  queue_;
+    FlightTable                    flights_;
+    boost::mutex                   costMutex_;
+    double                         averageCost_;   // In milliseconds, 0 if unknown
+
+    void RecordCreationCost(uint32_t cost);
+
+    bool IsPrefetchNeeded(const PrefetchRequest& prefetch);
+
+    void CreateBatch(const std::vector<PrefetchRequest>& batch);
+
+    void RunPrefetch(const PrefetchRequest& prefetch);
+
+  public:
+    BundleScheduler(CacheScheduler& scheduler,
+                    int bundleIndex,
+                    ICacheFactory* factory,
+                    ShardedCacheManager&  cacheManager,
+                    MemoryCache&    memoryCache,
+                    CacheLogger* cacheLogger,
+                    CacheExecutor& executor,
+                    PrefetchThrottle& throttle,
+                    size_t queueSize) :
+      scheduler_(scheduler),
+      bundleIndex_(bundleIndex),
+      factory_(factory),
+      cacheManager_(cacheManager),
+      memoryCache_(memoryCache),
+      cacheLogger_(cacheLogger),
+      executor_(executor),
+      throttle_(throttle),
+      queue_(queueSize),
+      averageCost_(0)
+    {
+    }
+
+    virtual bool RunOne()
+    {
+      if (!throttle_.TryStartPrefetch())
+      {
+        // The interactive requests come first
+        return false;
+      }
+
+      PrefetchRequest prefetch;
+      bool found = queue_.Dequeue(prefetch);
+
+      if (found)
+      {
+        RunPrefetch(prefetch);  // Never throws
+      }
+
+      throttle_.FinishPrefetch();
+      return found;
+    }
+
+    void Invalidate(const std::string& item)
+    {
+      // The items being created will not be stored
+      flights_.Invalidate(item);
+      factory_->Invalidate(item);
+    }
+
+    void Prefetch(const std::string& item,
+                  unsigned int qualityRank,
+                  unsigned int distance,
+                  const std::string& group,
+                  uint64_t generation)
+    {
+      queue_.Enqueue(item, qualityRank, distance, group, generation);
+      executor_.Signal();
+    }
+
+    // The executor is signaled by the caller, once for all the bundles
+    void Prefetch(const std::vector<const CacheIndex*>& items,
+                  const std::vector<const PrefetchRange*>& ranges,
+                  const std::map<std::string, uint64_t>& generations)
+    {
+      queue_.Enqueue(items, ranges, generations);
+    }
+
+    void SupersedePrefetch(const std::string& group,
+                           uint64_t generation)
+    {
+      queue_.Supersede(group, generation);
+    }
+
+    void SupersedeOtherPrefetches(const std::set<std::string>& groups)
+    {
+      queue_.SupersedeOthers(groups);
+    }
+
+    void CancelPrefetch(const std::string& group)
+    {
+      queue_.Cancel(group);
+    }
+
+    bool IsCancelled(const PrefetchRequest& request)
+    {
+      return scheduler_.IsPrefetchCancelled(request.group_, request.generation_);
+    }
+
+    double GetAverageCreationCost()
+    {
+      boost::mutex::scoped_lock lock(costMutex_);
+      return averageCost_;
+    }
+
+    // Creates the item with the factory and stores it in the cache. If
+    // another thread is already creating this item, its result is
+    // shared instead. "created" is only set if the item was created by
+    // this call. Returns "false" if the factory cannot create the item.
+    // If "prefetch" is given and gets cancelled meanwhile, the item is
+    // not stored, unless another request is waiting for it.
+    bool CreateItem(boost::shared_ptr<const StringCacheBuffer>& created,
+                    MemoryCache::Content& content,
+                    const std::string& item,
+                    const PrefetchRequest* prefetch)
+    {
+      created.reset();
+
+      for (;;)
+      {
+        boost::shared_ptr<Flight> flight;
+
+        if (!flights_.Join(flight, item))
+        {
+          cacheLogger_->LogCacheDebugInfo(std::string("waiting for the creation of ") + item);
+
+          switch (flight->Wait(content))
+          {
+            case Flight::State_Succeeded:
+              return true;
+
+            case Flight::State_Failed:
+              return false;
+
+            default:
+              // The creation was aborted, try again
+              continue;
+          }
+        }
+
+        try
+        {
+          // The item might have been stored by a flight that has just landed
+          if (memoryCache_.Access(content, bundleIndex_, item) ||
+              cacheManager_.Access(content, bundleIndex_, item))
+          {
+            flight->Finish(Flight::State_Succeeded, content);
+            flights_.Land(item, flight);
+            return true;
+          }
+
+          std::string buffer;
+          const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+          if (!factory_->Create(buffer, item))
+          {
+            flight->Finish(Flight::State_Failed, MemoryCache::Content());
+            flights_.Land(item, flight);
+            return false;
+          }
+
+          const uint32_t cost = GetCreationCost(start);
+          RecordCreationCost(cost);
+
+          boost::shared_ptr<const StringCacheBuffer> result(new StringCacheBuffer(buffer));
+          content = result;
+
+          bool aborted;
+
+          {
+            boost::mutex::scoped_lock lock(flight->GetMutex());
+
+            aborted = (flight->IsInvalidated() ||
+                       (prefetch != NULL &&
+                        !flight->HasWaiters() &&
+                        IsCancelled(*prefetch)));
+
+            if (!aborted)
+            {
+              cacheManager_.Store(bundleIndex_, item, result->GetContent(), cost);
+              cacheLogger_->LogCacheDebugInfo(std::string("stored ") + item);
+
+              // Created items are likely to be displayed soon, keep them in RAM
+              memoryCache_.Store(bundleIndex_, item, content);
+            }
+          }
+
+          // The waiters must not get the content of an invalidated item.
+          // The caller still gets it, as it requested it before.
+          flight->Finish(aborted ? Flight::State_Aborted : Flight::State_Succeeded, content);
+          flights_.Land(item, flight);
+
+          created = result;
+          return true;
+        }
+        catch (...)
+        {
+          flight->Finish(Flight::State_Aborted, MemoryCache::Content());
+          flights_.Land(item, flight);
+          throw;
+        }
+      }
+    }
+
+    ICacheFactory& GetFactory()
+    {
+      return *factory_;
+    }
+  };
+
+
+  void CacheScheduler::BundleScheduler::RecordCreationCost(uint32_t cost)
+  {
+    boost::mutex::scoped_lock lock(costMutex_);
+
+    // Exponential moving average, that follows the load of the server
+    if (averageCost_ == 0)
+    {
+      averageCost_ = static_cast<double>(cost);
+    }
+    else
+    {
+      averageCost_ = 0.9 * averageCost_ + 0.1 * static_cast<double>(cost);
+    }
+  }
+
+
+  bool CacheScheduler::BundleScheduler::IsPrefetchNeeded(const PrefetchRequest& prefetch)
+  {
+    if (IsCancelled(prefetch))
+    {
+      // The user is not looking at this group anymore
+      return false;
+    }
+
+    if (memoryCache_.IsCached(bundleIndex_, prefetch.item_))
+    {
+      // This item is already in the RAM tier
+      return false;
+    }
+
+    if (cacheManager_.IsCached(bundleIndex_, prefetch.item_))
+    {
+      // This item is already cached
+      return false;
+    }
+
+    return true;
+  }
+
+
+  // Creates several prefetched items with a single call to the factory,
+  // and stores them in one transaction. The items that are already being
+  // created by another thread are skipped.
+  void CacheScheduler::BundleScheduler::CreateBatch(const std::vector<PrefetchRequest>& batch)
+  {
+    std::vector<const PrefetchRequest*>      requests;
+    std::vector<boost::shared_ptr<Flight> >  flights;
+    std::vector<std::string>                 items;
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+      boost::shared_ptr<Flight> flight;
+      if (flights_.TryStart(flight, batch[i].item_))
+      {
+        requests.push_back(&batch[i]);
+        flights.push_back(flight);
+        items.push_back(batch[i].item_);
+      }
+    }
+
+    if (items.empty())
+    {
+      return;
+    }
+
+    try
+    {
+      std::vector<std::string> buffers;
+      const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+      if (!factory_->CreateBatch(buffers, items))
+      {
+        // Let the waiters retry, and create the items one by one
+        for (size_t i = 0; i < items.size(); i++)
+        {
+          flights[i]->Finish(Flight::State_Aborted, MemoryCache::Content());
+          flights_.Land(items[i], flights[i]);
+        }
+
+        for (size_t i = 0; i < items.size(); i++)
+        {
+          boost::shared_ptr<const StringCacheBuffer> created;
+          MemoryCache::Content content;
+
+          if (!CreateItem(created, content, items[i], requests[i]))
+          {
+            cacheLogger_->LogCacheDebugInfo(std::string("could not prefetch ") + items[i]);
+          }
+        }
+
+        return;
+      }
+
+      assert(buffers.size() == items.size());
+
+      // The decoding is shared by the whole batch, so is its cost
+      const uint32_t cost = GetCreationCost(start) / static_cast<uint32_t>(items.size());
+      RecordCreationCost(cost);
+
+      std::vector<MemoryCache::Content> contents(items.size());
+      std::vector<bool> aborted(items.size());
+
+      std::vector<std::string>          toStore;
+      std::vector<const std::string*>   toStoreContents;
+      std::vector<uint32_t>             toStoreCosts;
+
+      {
+        // No other thread locks several flights, the order does not matter
+        std::vector< boost::shared_ptr<boost::mutex::scoped_lock> > locks;
+
+        for (size_t i = 0; i < items.size(); i++)
+        {
+          boost::shared_ptr<const StringCacheBuffer> result(new StringCacheBuffer(buffers[i]));
+          contents[i] = result;
+
+          locks.push_back(boost::shared_ptr<boost::mutex::scoped_lock>
+                          (new boost::mutex::scoped_lock(flights[i]->GetMutex())));
+
+          aborted[i] = (flights[i]->IsInvalidated() ||
+                        (!flights[i]->HasWaiters() &&
+                         IsCancelled(*requests[i])));
+
+          if (!aborted[i])
+          {
+            toStore.push_back(items[i]);
+            toStoreContents.push_back(&result->GetContent());
+            toStoreCosts.push_back(cost);
+          }
+        }
+
+        cacheManager_.StoreBatch(bundleIndex_, toStore, toStoreContents, toStoreCosts);
+
+        for (size_t i = 0; i < items.size(); i++)
+        {
+          if (!aborted[i])
+          {
+            cacheLogger_->LogCacheDebugInfo(std::string("stored ") + items[i]);
+            memoryCache_.Store(bundleIndex_, items[i], contents[i]);
+          }
+        }
+      }
+
+      for (size_t i = 0; i < items.size(); i++)
+      {
+        flights[i]->Finish(aborted[i] ? Flight::State_Aborted : Flight::State_Succeeded, contents[i]);
+        flights_.Land(items[i], flights[i]);
+      }
+    }
+    catch (...)
+    {
+      // Landing twice is harmless
+      for (size_t i = 0; i < items.size(); i++)
+      {
+        flights[i]->Finish(Flight::State_Aborted, MemoryCache::Content());
+        flights_.Land(items[i], flights[i]);
+      }
+
+      throw;
+    }
+  }
+
+
+  void CacheScheduler::BundleScheduler::RunPrefetch(const PrefetchRequest& prefetch)
+  {
+    try
+    {
+      cacheLogger_->LogCacheDebugInfo(std::string("dequeued prefetching ") + prefetch.item_);
+
+      if (!IsPrefetchNeeded(prefetch))
+      {
+        return;
+      }
+
+      // The other pending items that can be created together with this
+      // one, e.g. the other qualities of the same frame
+      std::vector<PrefetchRequest> batch;
+
+      const std::string prefix = factory_->GetBatchPrefix(prefetch.item_);
+      if (!prefix.empty())
+      {
+        std::vector<PrefetchRequest> siblings;
+        queue_.TakeBatch(siblings, prefix);
+
+        for (size_t i = 0; i < siblings.size(); i++)
+        {
+          if (IsPrefetchNeeded(siblings[i]))
+          {
+            batch.push_back(siblings[i]);
+          }
+        }
+      }
+
+      boost::shared_ptr<const StringCacheBuffer> created;
+      MemoryCache::Content content;
+
+      try
+      {
+        throttle_.ConsumeToken();
+
+        if (batch.empty())
+        {
+          cacheLogger_->LogCacheDebugInfo(std::string("prefetching ") + prefetch.item_);
+
+          if (!CreateItem(created, content, prefetch.item_, &prefetch))
+          {
+            // The factory cannot generate this item
+            cacheLogger_->LogCacheDebugInfo(std::string("could not prefetch ") + prefetch.item_);
+          }
+        }
+        else
+        {
+          batch.insert(batch.begin(), prefetch);
+          cacheLogger_->LogCacheDebugInfo(std::string("prefetching the batch ") + prefix);
+          CreateBatch(batch);
+        }
+      }
+      catch (...)
+      {
+        // Exception
+      }
+    }
+    catch (std::bad_alloc&)
+    {
+      OrthancPluginLogError(cacheManager_.GetPluginContext(),
+                            "Not enough memory for the prefetcher of the Web viewer to work");
+    }
+    catch (...)
+    {
+      OrthancPluginLogError(cacheManager_.GetPluginContext(),
+                            "Unhandled native exception inside the prefetcher of the Web viewer");
+    }
+  }
+
+
+
+  // Accesses whose prefetch policy is still to be applied by the threads
+  // of the executor
+  class CacheScheduler::PolicyQueue : public CacheExecutor::IQueue
+  {
+  private:
+    struct Event
+    {
+      int                                         bundle_;
+      std::string                                 item_;
+      boost::shared_ptr<const StringCacheBuffer>  content_;   // NULL for a cache hit
+      uint64_t                                    sequence_;
+    };
+
+    CacheScheduler&    scheduler_;
+    boost::mutex       mutex_;
+    std::deque<Event>  events_;
+
+  public:
+    explicit PolicyQueue(CacheScheduler& scheduler) :
+      scheduler_(scheduler)
+    {
+    }
+
+    void Enqueue(int bundle,
+                 const std::string& item,
+                 const boost::shared_ptr<const StringCacheBuffer>& content,
+                 uint64_t sequence)
+    {
+      Event event;
+      event.bundle_ = bundle;
+      event.item_ = item;
+      event.content_ = content;
+      event.sequence_ = sequence;
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (events_.size() >= MAX_PENDING_POLICIES)
+      {
+        events_.pop_front();
+      }
+
+      events_.push_back(event);
+    }
+
+    // Returns "false" if this hit is coalesced with the previous event,
+    // e.g. when the same image is requested again
+    bool EnqueueHit(int bundle,
+                    const std::string& item,
+                    uint64_t sequence)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!events_.empty() &&
+          events_.back().bundle_ == bundle &&
+          events_.back().item_ == item)
+      {
+        return false;
+      }
+
+      if (events_.size() >= MAX_PENDING_POLICIES)
+      {
+        events_.pop_front();
+      }
+
+      Event event;
+      event.bundle_ = bundle;
+      event.item_ = item;
+      event.sequence_ = sequence;
+      events_.push_back(event);
+
+      return true;
+    }
+
+    virtual bool RunOne()
+    {
+      Event event;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (events_.empty())
+        {
+          return false;
+        }
+
+        event = events_.front();
+        events_.pop_front();
+      }
+
+      try
+      {
+        if (event.content_.get() == NULL)
+        {
+          scheduler_.ApplyHitPolicy(event.bundle_, event.item_, event.sequence_);
+        }
+        else
+        {
+          scheduler_.ApplyPrefetchPolicy(event.bundle_, event.item_, event.content_->GetContent(), event.sequence_);
+        }
+      }
+      catch (...)
+      {
+        OrthancPluginLogWarning(scheduler_.cacheManager_.GetPluginContext(),
+                                "Cannot apply the prefetch policy of the Web viewer");
+      }
+
+      return true;
+    }
+  };
+
+
+
+  CacheScheduler::BundleScheduler&  CacheScheduler::GetBundleScheduler(unsigned int bundleIndex)
+  {
+    boost::mutex::scoped_lock lock(factoryMutex_);
+
+    BundleSchedulers::iterator it = bundles_.find(bundleIndex);
+    if (it == bundles_.end())
+    {
+      // No factory associated with this bundle
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    return *(it->second);
+  }
+
+
+  
+  CacheScheduler::CacheScheduler(ShardedCacheManager& cacheManager,
+                                 CacheLogger* cacheLogger,
+                                 unsigned int maxPrefetchSize,
+                                 size_t threadsCount) :
+    maxPrefetchSize_(maxPrefetchSize),
+    cacheManager_(cacheManager),
+    cacheLogger_(cacheLogger),
+    policy_(NULL),
+    executor_(new CacheExecutor(cacheManager.GetPluginContext(), threadsCount)),
+    throttle_(new PrefetchThrottle(executor_->GetThreadsCount())),
+    policyQueue_(new PolicyQueue(*this)),
+    rewarmDone_(false),
+    lastGeneration_(0),
+    accessSequence_(0),
+    focusSequence_(0)
+  {
+    executor_->Register(*policyQueue_, POLICY_WEIGHT);
+  }
+
+
+  CacheScheduler::~CacheScheduler()
+  {
+    {
+      boost::mutex::scoped_lock lock(rewarmMutex_);
+      rewarmDone_ = true;
+    }
+
+    if (rewarmThread_.joinable())
+    {
+      rewarmThread_.join();
+    }
+
+    // The threads must be stopped before the queues they use are deleted
+    executor_.reset(NULL);
+
+    for (BundleSchedulers::iterator it = bundles_.begin(); 
+         it != bundles_.end(); it++)
+    {
+      delete it->second;
+    }
+  }
+
+
+  void CacheScheduler::Register(int bundle, 
+                                ICacheFactory* factory /* takes ownership */,
+                                unsigned int weight)
+  {
+    boost::mutex::scoped_lock lock(factoryMutex_);
+
+    BundleSchedulers::iterator it = bundles_.find(bundle);
+    if (it != bundles_.end())
+    {
+      // This bundle is already registered
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    BundleScheduler* scheduler = new BundleScheduler(*this, bundle, factory, cacheManager_, memoryCache_, cacheLogger_, *executor_, *throttle_, maxPrefetchSize_);
+    bundles_[bundle] = scheduler;
+    executor_->Register(*scheduler, weight);
+  }
+
+
+  void CacheScheduler::SetQuota(int bundle,
+                                uint32_t maxCount,
+                                uint64_t maxSpace,
+                                CacheEvictionPolicy policy)
+  {
+    cacheManager_.SetBundleQuota(bundle, maxCount, maxSpace, policy);
+  }
+
+
+  void CacheScheduler::SetSegmentStorageEnabled(int bundle,
+                                                bool enabled)
+  {
+    cacheManager_.SetSegmentStorageEnabled(bundle, enabled);
+  }
+
+
+  void CacheScheduler::SetPrefetchThrottling(unsigned int pauseThreshold,
+                                             double prefetchesPerSecond,
+                                             unsigned int burst)
+  {
+    throttle_->SetPauseThreshold(pauseThreshold);
+    throttle_->SetRate(prefetchesPerSecond, burst);
+  }
+
+
+  void CacheScheduler::SetMemoryQuota(int bundle,
+                                      uint64_t maxSpace)
+  {
+    memoryCache_.SetBundleQuota(bundle, maxSpace);
+    memoryQuotas_[bundle] = maxSpace;
+  }
+
+
+  bool CacheScheduler::IsRewarmDone()
+  {
+    boost::mutex::scoped_lock lock(rewarmMutex_);
+    return rewarmDone_;
+  }
+
+
+  void CacheScheduler::RewarmThread(CacheScheduler* that)
+  {
+    size_t count = 0;
+
+    for (MemoryQuotas::const_iterator
+           quota = that->memoryQuotas_.begin(); quota != that->memoryQuotas_.end(); ++quota)
+    {
+      if (quota->second == 0)
+      {
+        continue;
+      }
+
+      std::vector<std::string> items;
+      that->cacheManager_.GetMostRecentItems(items, quota->first, quota->second);
+
+      // Load the least recent items first, so that both the RAM tier and
+      // the disk cache keep the LRU order of the previous run
+      for (std::vector<std::string>::const_reverse_iterator
+             it = items.rbegin(); it != items.rend() && !that->IsRewarmDone(); ++it)
+      {
+        try
+        {
+          // Same guard against the concurrent invalidations as Access().
+          // The mapped items are copied by the RAM tier, so that they do
+          // not stay pinned on the disk.
+          const uint64_t epoch = that->memoryCache_.GetEpoch(quota->first);
+
+          MemoryCache::Content content;
+          if (!that->memoryCache_.IsCached(quota->first, *it) &&
+              that->cacheManager_.Access(content, quota->first, *it))
+          {
+            that->memoryCache_.Store(quota->first, *it, content, epoch);
+            count++;
+          }
+        }
+        catch (...)
+        {
+          OrthancPluginLogWarning(that->cacheManager_.GetPluginContext(),
+                                  "Cannot reload an item of the cache of the Web viewer in memory");
+        }
+      }
+    }
+
+    that->cacheLogger_->LogCacheDebugInfo("reloaded " + boost::lexical_cast<std::string>(count) + " items in memory");
+  }
+
+
+  void CacheScheduler::StartRewarm()
+  {
+    if (rewarmThread_.joinable())
+    {
+      // Already started
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    rewarmThread_ = boost::thread(RewarmThread, this);
+  }
+
+
+  void CacheScheduler::Invalidate(int bundle,
+                                  const std::string& item)
   {
-  private:
-    std::string   value_;
+    // Done first, so that an item that is being created is either not
+    // stored, or already stored and thus removed below
+    GetBundleScheduler(bundle).Invalidate(item);
 
-  public:
-    DynamicString(const std::string& value) : value_(value)
-    {
-    }
+    cacheManager_.Invalidate(bundle, item);
+    memoryCache_.Invalidate(bundle, item);
 
-    const std::string& GetValue() const
+    if (policy_.get() != NULL)
     {
-      return value_;
+      policy_->Invalidate(bundle, item);
     }
-  };
+  }
 
 
-  class CacheScheduler::PrefetchQueue : public boost::noncopyable
+  void CacheScheduler::ApplyPrefetchPolicy(int bundle,
+                                           const std::string& item,
+                                           const std::string& content,
+                                           uint64_t sequence)
   {
-  private:
-    boost::mutex                 mutex_;
-    Orthanc::SharedMessageQueue  queue_;
-    std::set<std::string>        content_;
-
-  public:
-    PrefetchQueue(size_t maxSize) : queue_(maxSize)
+    if (policy_.get() != NULL)
     {
-      queue_.SetLifoPolicy();
+      PrefetchBatch toPrefetch;
+      policy_->Apply(toPrefetch, *this, CacheIndex(bundle, item), content);
+
+      EnqueuePrefetch(toPrefetch, sequence);
     }
+  }
 
-    void Enqueue(const std::string& item)
-    {
-      boost::mutex::scoped_lock lock(mutex_);
 
-      if (content_.find(item) != content_.end())
-      {
-        // This cache index is already pending in the queue
-        return;
-      }
+  double CacheScheduler::GetCreationThroughput(int bundle)
+  {
+    const double cost = GetBundleScheduler(bundle).GetAverageCreationCost();
 
-      content_.insert(item);
-      queue_.Enqueue(new DynamicString(item));
+    if (cost <= 0)
+    {
+      return 0;
     }
-
-    DynamicString* Dequeue(int32_t msTimeout)
+    else
     {
-      std::auto_ptr<Orthanc::IDynamicObject> message(queue_.Dequeue(msTimeout));
-      if (message.get() == NULL)
-      {
-        return NULL;
-      }
+      return 1000.0 * static_cast<double>(executor_->GetThreadsCount()) / cost;
+    }
+  }
 
-      const DynamicString& index = dynamic_cast<const DynamicString&>(*message);
 
-      {
-        boost::mutex::scoped_lock lock(mutex_);
-        content_.erase(index.GetValue());
-      }
+  void CacheScheduler::ApplyHitPolicy(int bundle,
+                                      const std::string& item,
+                                      uint64_t sequence)
+  {
+    if (policy_.get() != NULL)
+    {
+      PrefetchBatch toPrefetch;
+      policy_->ApplyHit(toPrefetch, *this, CacheIndex(bundle, item));
 
-      return dynamic_cast<DynamicString*>(message.release());
+      EnqueuePrefetch(toPrefetch, sequence);
     }
-  };
+  }
 
 
-  class CacheScheduler::Prefetcher : public boost::noncopyable
+  void CacheScheduler::NotifyHit(int bundle,
+                                 const std::string& item)
   {
-  private:
-    int             bundleIndex_;
-    ICacheFactory&  factory_;
-    CacheManager&   cacheManager_;
-    CacheLogger*    cacheLogger_;
-    boost::mutex&   cacheMutex_;
-    PrefetchQueue&  queue_;
+    // Only a few locks on this path: the policy decides in the background
+    // whether the prefetch window must move forward
+    if (policy_.get() != NULL &&
+        policy_->IsFollowingHits(bundle) &&
+        policyQueue_->EnqueueHit(bundle, item, GetNextSequence()))
+    {
+      executor_->Signal();
+    }
+  }
 
-    bool            done_;
-    boost::thread   thread_;
-    boost::mutex    invalidatedMutex_;
-    bool            invalidated_;
-    std::string     prefetching_;
 
-    static void Worker(Prefetcher* that)
+  bool CacheScheduler::Access(std::string& content,
+                              int bundle,
+                              const std::string& item)
+  {
+    MemoryCache::Content shared;
+    if (Access(shared, bundle, item))
     {
-      while (!(that->done_))
-      {
-        std::auto_ptr<DynamicString> prefetch(that->queue_.Dequeue(500));
-
-        try
-        {
-          if (prefetch.get() != NULL)
-          {
-            that->cacheLogger_->LogCacheDebugInfo(std::string("dequeued prefetching ") + prefetch->GetValue());
-            {
-              boost::mutex::scoped_lock lock(that->invalidatedMutex_);
-              that->invalidated_ = false;
-              that->prefetching_ = prefetch->GetValue();
-            }
+      content.assign(shared->GetData(), shared->GetSize());
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
 
-            {
-              boost::mutex::scoped_lock lock(that->cacheMutex_);
-              if (that->cacheManager_.IsCached(that->bundleIndex_, prefetch->GetValue()))
-              {
-                // This item is already cached
-                continue;
-              }
-            }
 
-            std::string content;
+  bool CacheScheduler::AccessInBackground(std::string& content,
+                                          int bundle,
+                                          const std::string& item)
+  {
+    MemoryCache::Content shared;
+    if (AccessInternal(shared, bundle, item, false))
+    {
+      content.assign(shared->GetData(), shared->GetSize());
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
 
-            try
-            {
-              that->cacheLogger_->LogCacheDebugInfo(std::string("prefetching ") + prefetch->GetValue());
 
-              if (!that->factory_.Create(content, prefetch->GetValue()))
-              {
-                that->cacheLogger_->LogCacheDebugInfo(std::string("could not prefetch ") + prefetch->GetValue());
+  bool CacheScheduler::Access(MemoryCache::Content& content,
+                              int bundle,
+                              const std::string& item)
+  {
+    return AccessInternal(content, bundle, item, true);
+  }
 
-                // The factory cannot generate this item
-                continue;
-              }
-            }
-            catch (...)
-            {
-              // Exception
-              continue;
-            }
 
-            {
-              boost::mutex::scoped_lock lock(that->invalidatedMutex_);
-              if (that->invalidated_)
-              {
-                // This item has been invalidated
-                continue;
-              }
-              
-              {
-                boost::mutex::scoped_lock lock2(that->cacheMutex_);
-                that->cacheManager_.Store(that->bundleIndex_, prefetch->GetValue(), content);
-                that->cacheLogger_->LogCacheDebugInfo(std::string("stored ") + prefetch->GetValue());
-              }
-            }
-          }
-        }
-        catch (std::bad_alloc&)
-        {
-          OrthancPluginLogError(that->cacheManager_.GetPluginContext(),
-                                "Not enough memory for the prefetcher of the Web viewer to work");
-        }
-        catch (...)
-        {
-          OrthancPluginLogError(that->cacheManager_.GetPluginContext(),
-                                "Unhandled native exception inside the prefetcher of the Web viewer");
-        }
+  bool CacheScheduler::AccessInternal(MemoryCache::Content& content,
+                                      int bundle,
+                                      const std::string& item,
+                                      bool interactive)
+  {
+    if (memoryCache_.Access(content, bundle, item))
+    {
+      cacheLogger_->LogCacheDebugInfo(std::string("found in memory ") + item);
+      if (interactive)
+      {
+        NotifyHit(bundle, item);
       }
+      return true;
     }
 
+    // Read before the disk cache, so that an invalidation that runs
+    // concurrently cannot let a stale content into the RAM tier
+    const uint64_t epoch = memoryCache_.GetEpoch(bundle);
 
-  public:
-    Prefetcher(int             bundleIndex,
-               ICacheFactory&  factory,
-               CacheManager&   cacheManager,
-               CacheLogger*    cacheLogger,
-               boost::mutex&   cacheMutex,
-               PrefetchQueue&  queue) :
-      bundleIndex_(bundleIndex),
-      factory_(factory),
-      cacheManager_(cacheManager),
-      cacheMutex_(cacheMutex),
-      cacheLogger_(cacheLogger),
-      queue_(queue)
-    {
-      done_ = false;
-      thread_ = boost::thread(Worker, this);
-    }
-
-    ~Prefetcher()
+    // The large items are mapped from the disk, instead of being copied
+    if (cacheManager_.Access(content, bundle, item))
     {
-      done_ = true;
-      if (thread_.joinable())
+      cacheLogger_->LogCacheDebugInfo(std::string("found ") + item);
+      memoryCache_.Store(bundle, item, content, epoch);
+      if (interactive)
       {
-        thread_.join();
+        NotifyHit(bundle, item);
       }
+      return true;
     }
 
-    void SignalInvalidated(const std::string& item)
+    cacheLogger_->LogCacheDebugInfo(std::string("item not found, creating ") + item);
+
+    // Attaches to the creation of this item if it is already running,
+    // e.g. in a prefetcher
+    boost::shared_ptr<const StringCacheBuffer> created;
+
+    if (interactive)
     {
-      boost::mutex::scoped_lock lock(invalidatedMutex_);
+      PrefetchThrottle::Interactive pause(*throttle_);
 
-      if (prefetching_ == item)
+      if (!GetBundleScheduler(bundle).CreateItem(created, content, item, NULL))
       {
-        invalidated_ = true;
+        // This item cannot be generated by the factory
+        return false;
       }
     }
-  };
+    else if (!GetBundleScheduler(bundle).CreateItem(created, content, item, NULL))
+    {
+      return false;
+    }
 
+    if (interactive &&
+        created.get() != NULL &&
+        policy_.get() != NULL)
+    {
+      // The policy is applied in the background, once the response is sent
+      policyQueue_->Enqueue(bundle, item, created, GetNextSequence());
+      executor_->Signal();
+    }
+
+    return true;
+  }
 
 
-  class CacheScheduler::BundleScheduler
+  void CacheScheduler::Prefetch(int bundle,
+                                const std::string& item,
+                                unsigned int qualityRank,
+                                unsigned int distance)
   {
-  private:
-    std::auto_ptr<ICacheFactory>   factory_;
-    PrefetchQueue                  queue_;
-    std::vector<Prefetcher*>       prefetchers_;
+    cacheLogger_->LogCacheDebugInfo(std::string("enqueuing prefetch ") + item);
+    GetBundleScheduler(bundle).Prefetch(item, qualityRank, distance, "", 0);
+  }
 
-  public:
-    BundleScheduler(int bundleIndex,
-                    ICacheFactory* factory,
-                    CacheManager&   cacheManager,
-                    CacheLogger* cacheLogger,
-                    boost::mutex&   cacheMutex,
-                    size_t numThreads,
-                    size_t queueSize) :
-      factory_(factory),
-      queue_(queueSize)
+
+  void CacheScheduler::Prefetch(const PrefetchBatch& batch)
+  {
+    EnqueuePrefetch(batch, GetNextSequence());
+  }
+
+
+  void CacheScheduler::EnqueuePrefetch(const PrefetchBatch& batch,
+                                       uint64_t sequence)
+  {
+    if (batch.IsEmpty())
     {
-      prefetchers_.resize(numThreads, NULL);
+      return;
+    }
 
-      for (size_t i = 0; i < numThreads; i++)
-      {
-        prefetchers_[i] = new Prefetcher(bundleIndex, *factory_, cacheManager, cacheLogger, cacheMutex, queue_);
-      }
+    // Each batch starts a new generation of prefetches for the groups it
+    // refers to, which supersedes the former requests of these groups.
+    // The policies run concurrently: the batch of an access is dropped
+    // for the groups where a more recent access was already applied.
+    std::map<std::string, uint64_t> generations;
+    std::set<std::string> obsolete;
+
+    for (size_t i = 0; i < batch.GetItems().size(); i++)
+    {
+      generations[batch.GetItems() [i].GetGroup()] = 0;
     }
 
-    ~BundleScheduler()
+    for (size_t i = 0; i < batch.GetRanges().size(); i++)
     {
-      for (size_t i = 0; i < prefetchers_.size(); i++)
-      {
-        if (prefetchers_[i] != NULL)
-          delete prefetchers_[i];
-      }
+      generations[batch.GetRanges() [i].GetGroup()] = 0;
     }
 
-    void Invalidate(const std::string& item)
+    std::set<std::string> active;
+
+    for (std::map<std::string, uint64_t>::iterator
+           it = generations.begin(); it != generations.end(); ++it)
     {
-      for (size_t i = 0; i < prefetchers_.size(); i++)
+      if (!it->first.empty())
       {
-        prefetchers_[i]->SignalInvalidated(item);
+        if (StartPrefetchGeneration(it->second, it->first, sequence))
+        {
+          active.insert(it->first);
+        }
+        else
+        {
+          obsolete.insert(it->first);
+        }
       }
-      factory_->Invalidate(item);
     }
 
-    void Prefetch(const std::string& item)
+    // The user has moved to these groups: the windows of the other ones
+    // only get the threads that these groups leave idle
+    if (!active.empty())
     {
-      queue_.Enqueue(item);
+      SupersedeOtherGroups(active, sequence);
     }
 
-    bool CallFactory(std::string& content,
-                     const std::string& item)
+    // The items and ranges of each bundle, in their order in the batch
+    typedef std::map<int, std::vector<const CacheIndex*> >     BundleItems;
+    typedef std::map<int, std::vector<const PrefetchRange*> >  BundleRanges;
+    BundleItems items;
+    BundleRanges ranges;
+    std::set<int> bundles;
+
+    for (size_t i = 0; i < batch.GetItems().size(); i++)
     {
-      content.clear();
-      return factory_->Create(content, item);
+      const CacheIndex& item = batch.GetItems() [i];
+      if (obsolete.find(item.GetGroup()) == obsolete.end())
+      {
+        items[item.GetBundle()].push_back(&item);
+        bundles.insert(item.GetBundle());
+      }
     }
 
-    ICacheFactory& GetFactory()
+    for (size_t i = 0; i < batch.GetRanges().size(); i++)
     {
-      return *factory_;
+      const PrefetchRange& range = batch.GetRanges() [i];
+      if (obsolete.find(range.GetGroup()) == obsolete.end())
+      {
+        ranges[range.GetBundle()].push_back(&range);
+        bundles.insert(range.GetBundle());
+      }
     }
-  };
-
 
+    if (bundles.empty())
+    {
+      return;
+    }
 
-  CacheScheduler::BundleScheduler&  CacheScheduler::GetBundleScheduler(unsigned int bundleIndex)
-  {
-    boost::mutex::scoped_lock lock(factoryMutex_);
+    cacheLogger_->LogCacheDebugInfo("enqueuing a batch of " +
+                                    boost::lexical_cast<std::string>(batch.GetItems().size()) + " prefetches and " +
+                                    boost::lexical_cast<std::string>(batch.GetRanges().size()) + " ranges");
 
-    BundleSchedulers::iterator it = bundles_.find(bundleIndex);
-    if (it == bundles_.end())
+    for (std::set<int>::const_iterator bundle = bundles.begin(); bundle != bundles.end(); ++bundle)
     {
-      // No factory associated with this bundle
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      GetBundleScheduler(*bundle).Prefetch(items[*bundle], ranges[*bundle], generations);
     }
 
-    return *(it->second);
+    executor_->SignalAll();
   }
 
 
-  
-  CacheScheduler::CacheScheduler(CacheManager& cacheManager,
-                                 CacheLogger* cacheLogger,
-                                 unsigned int maxPrefetchSize) :
-    maxPrefetchSize_(maxPrefetchSize),
-    cacheManager_(cacheManager),
-    cacheLogger_(cacheLogger),
-    policy_(NULL)
+  void CacheScheduler::SupersedeOtherGroups(const std::set<std::string>& groups,
+                                            uint64_t sequence)
   {
-  }
+    {
+      boost::mutex::scoped_lock lock(generationsMutex_);
 
+      if (sequence < focusSequence_)
+      {
+        return;
+      }
 
-  CacheScheduler::~CacheScheduler()
-  {
-    for (BundleSchedulers::iterator it = bundles_.begin(); 
-         it != bundles_.end(); it++)
-    {
-      delete it->second;
+      focusSequence_ = sequence;
     }
-  }
 
-
-  void CacheScheduler::Register(int bundle, 
-                                ICacheFactory* factory /* takes ownership */,
-                                size_t  numThreads)
-  {
     boost::mutex::scoped_lock lock(factoryMutex_);
 
-    BundleSchedulers::iterator it = bundles_.find(bundle);
-    if (it != bundles_.end())
+    for (BundleSchedulers::iterator it = bundles_.begin(); it != bundles_.end(); ++it)
     {
-      // This bundle is already registered
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      it->second->SupersedeOtherPrefetches(groups);
     }
-
-    bundles_[bundle] = new BundleScheduler(bundle, factory, cacheManager_, cacheLogger_, cacheMutex_, numThreads, maxPrefetchSize_);
   }
 
 
-  void CacheScheduler::SetQuota(int bundle,
-                                uint32_t maxCount,
-                                uint64_t maxSpace)
+  uint64_t CacheScheduler::GetNextSequence()
   {
-    boost::mutex::scoped_lock lock(cacheMutex_);
-    cacheManager_.SetBundleQuota(bundle, maxCount, maxSpace);
+    boost::mutex::scoped_lock lock(generationsMutex_);
+    return ++accessSequence_;
   }
 
 
-  void CacheScheduler::Invalidate(int bundle,
-                                  const std::string& item)
+  bool CacheScheduler::StartPrefetchGeneration(uint64_t& generation,
+                                               const std::string& group,
+                                               uint64_t sequence)
   {
     {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      cacheManager_.Invalidate(bundle, item);
-    }
-
-    GetBundleScheduler(bundle).Invalidate(item);
-  }
-
+      boost::mutex::scoped_lock lock(generationsMutex_);
 
-  void CacheScheduler::ApplyPrefetchPolicy(int bundle,
-                                           const std::string& item,
-                                           const std::string& content)
-  {
-    boost::recursive_mutex::scoped_lock lock(policyMutex_);
+      PrefetchGenerations::iterator current = generations_.find(group);
+      if (current == generations_.end())
+      {
+        if (generations_.size() >= MAX_PREFETCH_GROUPS)
+        {
+          // Forget the least recently active group: its pending
+          // prefetches are cancelled once dequeued
+          PrefetchGenerations::iterator oldest = generations_.begin();
+          for (PrefetchGenerations::iterator it = generations_.begin(); it != generations_.end(); ++it)
+          {
+            if (it->second.sequence_ < oldest->second.sequence_)
+            {
+              oldest = it;
+            }
+          }
 
-    if (policy_.get() != NULL)
-    {
-      std::list<CacheIndex> toPrefetch;
+          generations_.erase(oldest);
+        }
 
-      {
-        policy_->Apply(toPrefetch, *this, CacheIndex(bundle, item), content);
+        PrefetchGeneration created;
+        created.first_ = lastGeneration_ + 1;
+        created.sequence_ = 0;
+        current = generations_.insert(std::make_pair(group, created)).first;
       }
 
-      for (std::list<CacheIndex>::const_reverse_iterator
-             it = toPrefetch.rbegin(); it != toPrefetch.rend(); ++it)
+      if (sequence < current->second.sequence_)
       {
-        Prefetch(it->GetBundle(), it->GetItem());
+        return false;
       }
+
+      current->second.sequence_ = sequence;
+      generation = ++lastGeneration_;
+    }
+
+    boost::mutex::scoped_lock lock(factoryMutex_);
+
+    for (BundleSchedulers::iterator it = bundles_.begin(); it != bundles_.end(); ++it)
+    {
+      it->second->SupersedePrefetch(group, generation);
     }
+
+    return true;
   }
 
 
-  bool CacheScheduler::Access(std::string& content,
-                              int bundle,
-                              const std::string& item)
+  uint64_t CacheScheduler::StartPrefetchGeneration(const std::string& group)
   {
-    bool existing;
+    uint64_t generation;
+    StartPrefetchGeneration(generation, group, GetNextSequence());
+    return generation;
+  }
 
-    {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      existing = cacheManager_.Access(content, bundle, item);
-    }
 
-    if (existing)
+  void CacheScheduler::CancelPrefetch(const std::string& group)
+  {
     {
-      cacheLogger_->LogCacheDebugInfo(std::string("found ") + item);
-//      ApplyPrefetchPolicy(bundle, item, content);
-      return true;
-    }
+      boost::mutex::scoped_lock lock(generationsMutex_);
 
-    cacheLogger_->LogCacheDebugInfo(std::string("item not found, creating ") + item);
-    if (!GetBundleScheduler(bundle).CallFactory(content, item))
-    {
-      // This item cannot be generated by the factory
-      return false;
-    }
+      PrefetchGenerations::iterator found = generations_.find(group);
+      if (found == generations_.end())
+      {
+        // No prefetch was ever enqueued for this group, or it was
+        // already forgotten
+        return;
+      }
 
-    {
-      boost::mutex::scoped_lock lock(cacheMutex_);
-      cacheManager_.Store(bundle, item, content);
+      // The requests of this group that are being created are cancelled,
+      // as their generation is not tracked anymore
+      generations_.erase(found);
     }
 
-    ApplyPrefetchPolicy(bundle, item, content);
+    boost::mutex::scoped_lock lock(factoryMutex_);
 
-    return true;
+    for (BundleSchedulers::iterator it = bundles_.begin(); it != bundles_.end(); ++it)
+    {
+      it->second->CancelPrefetch(group);
+    }
   }
 
 
-  void CacheScheduler::Prefetch(int bundle,
-                                const std::string& item)
+  bool CacheScheduler::IsPrefetchCancelled(const std::string& group,
+                                           uint64_t generation)
   {
-    cacheLogger_->LogCacheDebugInfo(std::string("enqueuing prefetch ") + item);
-    GetBundleScheduler(bundle).Prefetch(item);
+    boost::mutex::scoped_lock lock(generationsMutex_);
+
+    if (group.empty())
+    {
+      // Prefetches without a group are never cancelled
+      return false;
+    }
+
+    PrefetchGenerations::const_iterator found = generations_.find(group);
+    return (found == generations_.end() ||
+            generation < found->second.first_);
   }
 
 
   void CacheScheduler::RegisterPolicy(IPrefetchPolicy* policy)
   {
-    boost::recursive_mutex::scoped_lock lock(policyMutex_);
     policy_.reset(policy);
   }
 
@@ -447,7 +2005,6 @@ namespace OrthancPlugins
   void CacheScheduler::SetProperty(CacheProperty property,
                    const std::string& value)
   {
-    boost::mutex::scoped_lock lock(cacheMutex_);
     cacheManager_.SetProperty(property, value);
   }
 
@@ -455,14 +2012,14 @@ namespace OrthancPlugins
   bool CacheScheduler::LookupProperty(std::string& target,
                                       CacheProperty property)
   {
-    boost::mutex::scoped_lock lock(cacheMutex_);
     return cacheManager_.LookupProperty(target, property);
   }
 
 
   void CacheScheduler::Clear()
   {
-    boost::mutex::scoped_lock lock(cacheMutex_);
-    return cacheManager_.Clear();
+    // Same order as Invalidate()
+    cacheManager_.Clear();
+    memoryCache_.Clear();
   }
 }
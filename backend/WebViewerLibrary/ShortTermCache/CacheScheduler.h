@@ -21,12 +21,17 @@
 
 #pragma once
 
-#include "CacheManager.h"
+#include "CacheExecutor.h"
+#include "PrefetchThrottle.h"
+#include "ShardedCacheManager.h"
+#include "MemoryCache.h"
 #include "ICacheFactory.h"
 #include "IPrefetchPolicy.h"
+#include "PrefetchBatch.h"
 #include "Core/MultiThreading/SharedMessageQueue.h"
 
 #include <boost/thread.hpp>
+#include <set>
 #include <stdio.h>
 
 class CacheLogger;
@@ -36,42 +41,141 @@ namespace OrthancPlugins
   class CacheScheduler : public boost::noncopyable
   {
   private:
-    class Prefetcher;
+    class Flight;
+    class FlightTable;
     class PrefetchQueue;
     class BundleScheduler;
+    class PolicyQueue;
 
-    typedef std::map<int, BundleScheduler*>  BundleSchedulers;
+    // The generations are numbered across all the groups, so that a
+    // group can be forgotten and started again
+    struct PrefetchGeneration
+    {
+      uint64_t  first_;      // The older generations of the group are cancelled
+      uint64_t  sequence_;   // Most recent access applied to this group
+    };
+
+    typedef std::map<int, BundleScheduler*>             BundleSchedulers;
+    typedef std::map<int, uint64_t>                     MemoryQuotas;
+    typedef std::map<std::string, PrefetchGeneration>  PrefetchGenerations;
 
     size_t                          maxPrefetchSize_;
-    boost::mutex                    cacheMutex_;
     boost::mutex                    factoryMutex_;
-    boost::recursive_mutex          policyMutex_;
-    CacheManager&                   cacheManager_;
+    ShardedCacheManager&            cacheManager_;
+    MemoryCache                     memoryCache_;
     CacheLogger*                    cacheLogger_;
     std::auto_ptr<IPrefetchPolicy>  policy_;
+    std::auto_ptr<CacheExecutor>    executor_;
+    std::auto_ptr<PrefetchThrottle> throttle_;
+    std::auto_ptr<PolicyQueue>      policyQueue_;
     BundleSchedulers                bundles_;
+    MemoryQuotas                    memoryQuotas_;
+    boost::mutex                    rewarmMutex_;
+    bool                            rewarmDone_;   // Protected by rewarmMutex_
+    boost::thread                   rewarmThread_;
+    boost::mutex                    generationsMutex_;
+    PrefetchGenerations             generations_;
+    uint64_t                        lastGeneration_;
+    uint64_t                        accessSequence_;
+    uint64_t                        focusSequence_;   // Last batch that postponed the other groups
+
+    bool IsRewarmDone();
+
+    static void RewarmThread(CacheScheduler* that);
+
+    bool IsPrefetchCancelled(const std::string& group,
+                             uint64_t generation);
+
+    uint64_t GetNextSequence();
+
+    // Returns "false" if the prefetches of a more recent access of this
+    // group were already enqueued
+    bool StartPrefetchGeneration(uint64_t& generation,
+                                 const std::string& group,
+                                 uint64_t sequence);
+
+    void EnqueuePrefetch(const PrefetchBatch& batch,
+                         uint64_t sequence);
+
+    // Postpones the pending prefetches of all the groups but these ones,
+    // unless a more recent batch already did so
+    void SupersedeOtherGroups(const std::set<std::string>& groups,
+                              uint64_t sequence);
 
     void ApplyPrefetchPolicy(int bundle,
                              const std::string& item,
-                             const std::string& content);
+                             const std::string& content,
+                             uint64_t sequence);
+
+    void ApplyHitPolicy(int bundle,
+                        const std::string& item,
+                        uint64_t sequence);
+
+    // Reports a cache hit to the policy, if it follows the hits
+    void NotifyHit(int bundle,
+                   const std::string& item);
 
     BundleScheduler&  GetBundleScheduler(unsigned int bundleIndex);
 
+    // A non-interactive access neither pauses the prefetching, nor
+    // applies the policy to the accessed item
+    bool AccessInternal(MemoryCache::Content& content,
+                        int bundle,
+                        const std::string& item,
+                        bool interactive);
+
   public:
-    CacheScheduler(CacheManager& cacheManager,
+    CacheScheduler(ShardedCacheManager& cacheManager,
                    CacheLogger* cacheLogger,
-                   unsigned int maxPrefetchSize);
+                   unsigned int maxPrefetchSize,
+                   size_t threadsCount);
 
     ~CacheScheduler();
 
+    // The prefetches of all the bundles share the threads of a single
+    // executor. While several bundles have pending prefetches, each one
+    // gets a share of the threads that is proportional to its weight.
     void Register(int bundle,
                   ICacheFactory* factory /* takes ownership */,
-                  size_t  numThreads);
+                  unsigned int weight);
+
+    // Shared pool of threads, to be used by the background tasks of the
+    // Web viewer, so that they do not oversubscribe the CPU
+    CacheExecutor& GetExecutor()
+    {
+      return *executor_;
+    }
 
     void SetQuota(int bundle,
                   uint32_t maxCount,
-                  uint64_t maxSpace);
-
+                  uint64_t maxSpace,
+                  CacheEvictionPolicy policy = CacheEvictionPolicy_LeastRecentlyUsed);
+
+    // Packs the items of this bundle into large segment files, instead
+    // of writing one file per item
+    void SetSegmentStorageEnabled(int bundle,
+                                  bool enabled);
+
+    // The prefetching pauses while "pauseThreshold" interactive requests
+    // (0 for no limit) are creating items, and is limited to a number of
+    // prefetches per second (0 for no limit)
+    void SetPrefetchThrottling(unsigned int pauseThreshold,
+                               double prefetchesPerSecond,
+                               unsigned int burst);
+
+    // Byte budget of the RAM tier for this bundle (0 to disable it)
+    void SetMemoryQuota(int bundle,
+                        uint64_t maxSpace);
+
+    // Reloads in the background the most recently used items of the
+    // previous run into the RAM tier, within its quotas. Must be called
+    // after the quotas are set.
+    void StartRewarm();
+
+    // The policy is applied by the threads of the executor after each
+    // item created by Access(), so that the response is not delayed by
+    // it, and after the hits it follows. Must be called before the first
+    // access.
     void RegisterPolicy(IPrefetchPolicy* policy /* takes ownership */);
 
     void Invalidate(int bundle,
@@ -81,11 +185,47 @@ namespace OrthancPlugins
                 int bundle,
                 const std::string& item);
 
+    // Same as above, but shares the cached buffer instead of copying it
+    bool Access(MemoryCache::Content& content,
+                int bundle,
+                const std::string& item);
+
+    // Access by a background task of the Web viewer, that is not
+    // reported to the prefetch policy
+    bool AccessInBackground(std::string& content,
+                            int bundle,
+                            const std::string& item);
+
+    // The items with the lowest quality rank are prefetched first, then
+    // the ones that are the closest to the displayed slice
     void Prefetch(int bundle,
-                  const std::string& item);
+                  const std::string& item,
+                  unsigned int qualityRank = 0,
+                  unsigned int distance = 0);
+
+    // Enqueues all the items and ranges of the batch with a single lock
+    // of the queue of each bundle, and wakes up the threads once. The
+    // batch starts a new generation of prefetches for each of its groups,
+    // and postpones the pending prefetches of the other groups (e.g. the
+    // series that the user has left).
+    void Prefetch(const PrefetchBatch& batch);
+
+    // Starts a new generation of prefetches for a group of items (e.g.
+    // a series). The pending prefetches of the former generations of
+    // this group are postponed after all the other ones.
+    uint64_t StartPrefetchGeneration(const std::string& group);
+
+    // Drops the pending prefetches of this group, and forgets about it.
+    // The items that are being prefetched are not stored, unless a
+    // request waits for them.
+    void CancelPrefetch(const std::string& group);
 
     ICacheFactory& GetFactory(int bundle);
 
+    // Number of items of this bundle that can be created per second, as
+    // measured on the recent creations (0 if unknown)
+    double GetCreationThroughput(int bundle);
+
     void SetProperty(CacheProperty property,
                      const std::string& value);
 
@@ -22,6 +22,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <boost/noncopyable.hpp>
 
 
@@ -39,6 +40,34 @@ namespace OrthancPlugins
     virtual bool Create(std::string& content,
                         const std::string& key) = 0;
 
+    // The items that share the same non-empty prefix can be created by
+    // a single call to CreateBatch(), e.g. several qualities of the same
+    // frame that are computed from one decoding. The prefix must begin
+    // with the resource identifier, so that the batch lives in one shard.
+    virtual std::string GetBatchPrefix(const std::string& /*item*/)
+    {
+      return "";
+    }
+
+    // Creates several items that share the same batch prefix. Returns
+    // "false" if any of them cannot be created, in which case the items
+    // are created one by one with Create(). Same warning as Create().
+    virtual bool CreateBatch(std::vector<std::string>& contents,
+                             const std::vector<std::string>& items)
+    {
+      contents.resize(items.size());
+
+      for (size_t i = 0; i < items.size(); i++)
+      {
+        if (!Create(contents[i], items[i]))
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
     virtual void Invalidate(const std::string& item) = 0;
   };
 }
@@ -22,9 +22,9 @@
 #pragma once
 
 #include "CacheIndex.h"
+#include "PrefetchBatch.h"
 
 #include <boost/noncopyable.hpp>
-#include <list>
 
 namespace OrthancPlugins
 {
@@ -37,11 +37,36 @@ namespace OrthancPlugins
     {
     }
 
-    // Mutual exclusion is enforced when calling this method.
-    // "toPrefetch" must be listed from top-priority to low-priority.
-    virtual void Apply(std::list<CacheIndex>& toPrefetch,
+    // WARNING: No mutual exclusion is enforced! Several threads could
+    // call this method at the same time. The items
+    // of "toPrefetch" are ordered by their quality rank and distance,
+    // then by their order in the batch (from top-priority to low-priority).
+    virtual void Apply(PrefetchBatch& toPrefetch,
                        CacheScheduler& cache,
                        const CacheIndex& index,
                        const std::string& content) = 0;
+
+    // Tells whether the cache hits of this bundle are reported to
+    // ApplyHit(). This is called on each hit, hence must be cheap.
+    virtual bool IsFollowingHits(int /*bundle*/) const
+    {
+      return false;
+    }
+
+    // Applied in the background after a cache hit, so that the prefetch
+    // window follows the user who scrolls through cached items. The same
+    // warning as for Apply() holds.
+    virtual void ApplyHit(PrefetchBatch& /*toPrefetch*/,
+                          CacheScheduler& /*cache*/,
+                          const CacheIndex& /*index*/)
+    {
+    }
+
+    // Called when an item is invalidated in the cache, so that the
+    // policy drops what it derived from this item
+    virtual void Invalidate(int /*bundle*/,
+                            const std::string& /*item*/)
+    {
+    }
   };
 }
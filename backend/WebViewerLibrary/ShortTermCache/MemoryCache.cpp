@@ -0,0 +1,318 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MemoryCache.h"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <cassert>
+#include <list>
+
+
+namespace OrthancPlugins
+{
+  class MemoryCache::Bundle : public boost::noncopyable
+  {
+  private:
+    typedef std::list<std::string>  Recency;   // Front is the most recently used item
+
+    struct Entry
+    {
+      Content            content_;
+      Recency::iterator  position_;
+    };
+
+    // An ordered map is used so that prefix invalidation is a range scan
+    typedef std::map<std::string, Entry>  Entries;
+
+    uint64_t  maxSpace_;
+    uint64_t  space_;
+    uint64_t  epoch_;
+    Entries   entries_;
+    Recency   recency_;
+
+    void Remove(Entries::iterator entry)
+    {
+      space_ -= entry->second.content_->GetSize();
+      recency_.erase(entry->second.position_);
+      entries_.erase(entry);
+    }
+
+    void MakeRoom()
+    {
+      while (space_ > maxSpace_ &&
+             !recency_.empty())
+      {
+        Entries::iterator oldest = entries_.find(recency_.back());
+        assert(oldest != entries_.end());
+        Remove(oldest);
+      }
+    }
+
+  public:
+    Bundle() : maxSpace_(0), space_(0), epoch_(0)
+    {
+    }
+
+    uint64_t GetEpoch() const
+    {
+      return epoch_;
+    }
+
+    uint64_t GetMaxSpace() const
+    {
+      return maxSpace_;
+    }
+
+    void SetMaxSpace(uint64_t maxSpace)
+    {
+      maxSpace_ = maxSpace;
+      MakeRoom();
+    }
+
+    bool Access(Content& content,
+                const std::string& item)
+    {
+      Entries::iterator found = entries_.find(item);
+      if (found == entries_.end())
+      {
+        return false;
+      }
+
+      // Move the item to the front of the LRU list
+      recency_.splice(recency_.begin(), recency_, found->second.position_);
+      content = found->second.content_;
+      return true;
+    }
+
+    bool IsCached(const std::string& item) const
+    {
+      return entries_.find(item) != entries_.end();
+    }
+
+    void Store(const std::string& item,
+               const Content& content)
+    {
+      Entries::iterator previous = entries_.find(item);
+      if (previous != entries_.end())
+      {
+        Remove(previous);
+      }
+
+      if (content.get() == NULL ||
+          content->GetSize() > maxSpace_)
+      {
+        // Too large to be kept in RAM, the disk cache will serve it
+        return;
+      }
+
+      recency_.push_front(item);
+
+      Entry& entry = entries_[item];
+      entry.content_ = content;
+      entry.position_ = recency_.begin();
+      space_ += content->GetSize();
+
+      MakeRoom();
+    }
+
+    void Invalidate(const std::string& itemPrefix)
+    {
+      epoch_++;
+
+      Entries::iterator it = entries_.lower_bound(itemPrefix);
+      while (it != entries_.end() &&
+             boost::starts_with(it->first, itemPrefix))
+      {
+        Remove(it++);
+      }
+    }
+
+    void Clear()
+    {
+      epoch_++;
+      entries_.clear();
+      recency_.clear();
+      space_ = 0;
+    }
+  };
+
+
+  MemoryCache::Bundle* MemoryCache::LookupBundle(int bundleIndex)
+  {
+    Bundles::iterator found = bundles_.find(bundleIndex);
+
+    if (found == bundles_.end() ||
+        found->second->GetMaxSpace() == 0)
+    {
+      return NULL;
+    }
+    else
+    {
+      return found->second;
+    }
+  }
+
+
+  MemoryCache::MemoryCache()
+  {
+  }
+
+
+  MemoryCache::~MemoryCache()
+  {
+    for (Bundles::iterator it = bundles_.begin(); it != bundles_.end(); ++it)
+    {
+      delete it->second;
+    }
+  }
+
+
+  void MemoryCache::SetBundleQuota(int bundleIndex,
+                                   uint64_t maxSpace)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Bundles::iterator found = bundles_.find(bundleIndex);
+    if (found == bundles_.end())
+    {
+      found = bundles_.insert(std::make_pair(bundleIndex, new Bundle)).first;
+    }
+
+    found->second->SetMaxSpace(maxSpace);
+  }
+
+
+  bool MemoryCache::Access(Content& content,
+                           int bundleIndex,
+                           const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Bundle* bundle = LookupBundle(bundleIndex);
+    return (bundle != NULL &&
+            bundle->Access(content, item));
+  }
+
+
+  bool MemoryCache::IsCached(int bundleIndex,
+                             const std::string& item)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Bundle* bundle = LookupBundle(bundleIndex);
+    return (bundle != NULL &&
+            bundle->IsCached(item));
+  }
+
+
+  MemoryCache::Content MemoryCache::CopyIfMapped(int bundleIndex,
+                                                 const Content& content)
+  {
+    if (dynamic_cast<const MappedCacheBuffer*>(content.get()) == NULL)
+    {
+      return content;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Bundle* bundle = LookupBundle(bundleIndex);
+      if (bundle == NULL ||
+          content->GetSize() > bundle->GetMaxSpace())
+      {
+        // Will not be kept in RAM, do not copy it
+        return content;
+      }
+    }
+
+    // The view pins its file in the disk cache, and its pages are not on
+    // the heap: keep a copy instead, outside of the lock
+    std::string copy(content->GetData(), content->GetSize());
+    return Content(new StringCacheBuffer(copy));
+  }
+
+
+  void MemoryCache::Store(int bundleIndex,
+                          const std::string& item,
+                          const Content& content)
+  {
+    const Content stored = CopyIfMapped(bundleIndex, content);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Bundle* bundle = LookupBundle(bundleIndex);
+    if (bundle != NULL)
+    {
+      bundle->Store(item, stored);
+    }
+  }
+
+
+  uint64_t MemoryCache::GetEpoch(int bundleIndex)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Bundle* bundle = LookupBundle(bundleIndex);
+    return (bundle == NULL ? 0 : bundle->GetEpoch());
+  }
+
+
+  void MemoryCache::Store(int bundleIndex,
+                          const std::string& item,
+                          const Content& content,
+                          uint64_t epoch)
+  {
+    const Content stored = CopyIfMapped(bundleIndex, content);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Bundle* bundle = LookupBundle(bundleIndex);
+    if (bundle != NULL &&
+        bundle->GetEpoch() == epoch)
+    {
+      bundle->Store(item, stored);
+    }
+  }
+
+
+  void MemoryCache::Invalidate(int bundleIndex,
+                               const std::string& itemPrefix)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Bundle* bundle = LookupBundle(bundleIndex);
+    if (bundle != NULL)
+    {
+      bundle->Invalidate(itemPrefix);
+    }
+  }
+
+
+  void MemoryCache::Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (Bundles::iterator it = bundles_.begin(); it != bundles_.end(); ++it)
+    {
+      it->second->Clear();
+    }
+  }
+}
@@ -0,0 +1,94 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "CacheBuffer.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <string>
+#include <stdint.h>
+
+namespace OrthancPlugins
+{
+  // RAM-resident LRU tier that sits in front of the CacheManager. The
+  // cached values are shared and immutable, so that a hit only has to
+  // increment a reference counter (no disk access, no SQLite).
+  class MemoryCache : public boost::noncopyable
+  {
+  public:
+    typedef CacheBufferPtr  Content;
+
+  private:
+    class Bundle;
+
+    typedef std::map<int, Bundle*>  Bundles;
+
+    boost::mutex  mutex_;
+    Bundles       bundles_;
+
+    Bundle* LookupBundle(int bundleIndex);
+
+    // The RAM tier only keeps contents that are on the heap, so that the
+    // files of the disk cache are only pinned while a request reads them
+    Content CopyIfMapped(int bundleIndex,
+                         const Content& content);
+
+  public:
+    MemoryCache();
+
+    ~MemoryCache();
+
+    // A bundle is only kept in RAM once it has a non-zero quota
+    void SetBundleQuota(int bundle,
+                        uint64_t maxSpace);
+
+    bool Access(Content& content,
+                int bundle,
+                const std::string& item);
+
+    bool IsCached(int bundle,
+                  const std::string& item);
+
+    void Store(int bundle,
+               const std::string& item,
+               const Content& content);
+
+    // Incremented by each invalidation of the bundle
+    uint64_t GetEpoch(int bundle);
+
+    // Same as above, for a content that was read from the disk cache
+    // after GetEpoch() returned "epoch". The content is dropped if the
+    // bundle was invalidated meanwhile, as it might be stale.
+    void Store(int bundle,
+               const std::string& item,
+               const Content& content,
+               uint64_t epoch);
+
+    void Invalidate(int bundle,
+                    const std::string& itemPrefix);
+
+    void Clear();
+  };
+}
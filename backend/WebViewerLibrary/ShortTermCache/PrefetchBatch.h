@@ -0,0 +1,166 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "CacheIndex.h"
+
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  // Compact description of the prefetch of a range of slices of a series
+  // in several qualities. Its items "{slice}/{quality}" are only built by
+  // the prefetching threads, when their turn comes. They are ordered by
+  // quality rank (the rank of a quality is its index), then by distance
+  // to the displayed slice, the previous slices first unless the user is
+  // scrolling forward.
+  class PrefetchRange
+  {
+  public:
+    typedef std::vector<std::string>  Slices;
+
+  private:
+    int                                bundle_;
+    boost::shared_ptr<const Slices>    slices_;
+    size_t                             begin_;
+    size_t                             end_;
+    size_t                             position_;
+    std::vector<std::string>           qualities_;
+    std::string                        group_;
+    bool                               forwardFirst_;
+
+  public:
+    // The slices are shared, not copied. "end" is clamped to their number.
+    PrefetchRange(int bundle,
+                  const boost::shared_ptr<const Slices>& slices,
+                  size_t begin,
+                  size_t end,
+                  size_t position,
+                  const std::vector<std::string>& qualities,
+                  const std::string& group,
+                  bool forwardFirst = false) :
+      bundle_(bundle),
+      slices_(slices),
+      begin_(begin),
+      end_(end < slices->size() ? end : slices->size()),
+      position_(position),
+      qualities_(qualities),
+      group_(group),
+      forwardFirst_(forwardFirst)
+    {
+    }
+
+    int GetBundle() const
+    {
+      return bundle_;
+    }
+
+    const Slices& GetSlices() const
+    {
+      return *slices_;
+    }
+
+    size_t GetBegin() const
+    {
+      return begin_;
+    }
+
+    size_t GetEnd() const
+    {
+      return end_;
+    }
+
+    size_t GetPosition() const
+    {
+      return position_;
+    }
+
+    const std::vector<std::string>& GetQualities() const
+    {
+      return qualities_;
+    }
+
+    const std::string& GetGroup() const
+    {
+      return group_;
+    }
+
+    bool IsForwardFirst() const
+    {
+      return forwardFirst_;
+    }
+
+    bool IsEmpty() const
+    {
+      return begin_ >= end_ || qualities_.empty();
+    }
+
+    std::string GetItem(size_t slice,
+                        size_t quality) const
+    {
+      return (*slices_) [slice] + "/" + qualities_[quality];
+    }
+  };
+
+
+  // Set of prefetches that are enqueued at once, with a single lock of
+  // the queue of each bundle and a single wakeup of the threads. The
+  // first listed items have the highest priority among the items with
+  // the same quality rank and distance.
+  class PrefetchBatch
+  {
+  private:
+    std::vector<CacheIndex>     items_;
+    std::vector<PrefetchRange>  ranges_;
+
+  public:
+    void AddItem(const CacheIndex& item)
+    {
+      items_.push_back(item);
+    }
+
+    void AddRange(const PrefetchRange& range)
+    {
+      if (!range.IsEmpty())
+      {
+        ranges_.push_back(range);
+      }
+    }
+
+    const std::vector<CacheIndex>& GetItems() const
+    {
+      return items_;
+    }
+
+    const std::vector<PrefetchRange>& GetRanges() const
+    {
+      return ranges_;
+    }
+
+    bool IsEmpty() const
+    {
+      return items_.empty() && ranges_.empty();
+    }
+  };
+}
@@ -0,0 +1,137 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "PrefetchThrottle.h"
+
+#include <algorithm>
+
+
+namespace OrthancPlugins
+{
+  PrefetchThrottle::PrefetchThrottle(unsigned int maxRunning) :
+    maxRunning_(std::max(maxRunning, 1u)),
+    pauseThreshold_(0),
+    rate_(0),
+    burst_(0),
+    tokens_(0),
+    lastRefill_(boost::posix_time::microsec_clock::universal_time()),
+    interactive_(0),
+    running_(0)
+  {
+  }
+
+
+  void PrefetchThrottle::SetPauseThreshold(unsigned int threshold)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    pauseThreshold_ = threshold;
+  }
+
+
+  void PrefetchThrottle::SetRate(double prefetchesPerSecond,
+                                 unsigned int burst)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    rate_ = std::max(prefetchesPerSecond, 0.0);
+    burst_ = std::max(burst, 1u);
+    tokens_ = burst_;
+    lastRefill_ = boost::posix_time::microsec_clock::universal_time();
+  }
+
+
+  void PrefetchThrottle::Refill()
+  {
+    // The mutex must be locked
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    const double elapsed = static_cast<double>((now - lastRefill_).total_microseconds()) / 1000000.0;
+
+    tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+    lastRefill_ = now;
+  }
+
+
+  PrefetchThrottle::Interactive::Interactive(PrefetchThrottle& throttle) :
+    throttle_(throttle)
+  {
+    boost::mutex::scoped_lock lock(throttle_.mutex_);
+    throttle_.interactive_++;
+  }
+
+
+  PrefetchThrottle::Interactive::~Interactive()
+  {
+    boost::mutex::scoped_lock lock(throttle_.mutex_);
+    throttle_.interactive_--;
+  }
+
+
+  bool PrefetchThrottle::TryStartPrefetch()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (pauseThreshold_ != 0 &&
+        interactive_ >= pauseThreshold_)
+    {
+      return false;
+    }
+
+    // Each pending interactive request takes the place of a prefetch
+    if (running_ + interactive_ >= maxRunning_)
+    {
+      return false;
+    }
+
+    if (rate_ > 0)
+    {
+      Refill();
+      if (tokens_ < 1)
+      {
+        return false;
+      }
+    }
+
+    running_++;
+    return true;
+  }
+
+
+  void PrefetchThrottle::ConsumeToken()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (rate_ > 0)
+    {
+      Refill();
+      tokens_ -= 1;
+    }
+  }
+
+
+  void PrefetchThrottle::FinishPrefetch()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (running_ > 0)
+    {
+      running_--;
+    }
+  }
+}
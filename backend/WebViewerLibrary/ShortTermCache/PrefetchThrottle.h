@@ -0,0 +1,79 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  // Gives priority to the interactive requests over the prefetching: the
+  // number of prefetches that run at the same time shrinks while
+  // interactive requests are creating items, and the prefetching pauses
+  // once too many of them are pending. In addition, the rate of the
+  // prefetches can be bounded by a token bucket.
+  class PrefetchThrottle : public boost::noncopyable
+  {
+  private:
+    boost::mutex              mutex_;
+    unsigned int              maxRunning_;
+    unsigned int              pauseThreshold_;  // 0 to never pause
+    double                    rate_;            // Per second, 0 for no limit
+    double                    burst_;
+    double                    tokens_;
+    boost::posix_time::ptime  lastRefill_;
+    unsigned int              interactive_;
+    unsigned int              running_;
+
+    void Refill();
+
+  public:
+    explicit PrefetchThrottle(unsigned int maxRunning);
+
+    void SetPauseThreshold(unsigned int threshold);
+
+    void SetRate(double prefetchesPerSecond,
+                 unsigned int burst);
+
+    // Tracks an interactive request while it creates an item
+    class Interactive : public boost::noncopyable
+    {
+    private:
+      PrefetchThrottle&  throttle_;
+
+    public:
+      explicit Interactive(PrefetchThrottle& throttle);
+
+      ~Interactive();
+    };
+
+    // Returns "false" if no prefetch should be started for now.
+    // Otherwise, FinishPrefetch() must be called once it is done.
+    bool TryStartPrefetch();
+
+    // Called when a started prefetch actually creates an item
+    void ConsumeToken();
+
+    void FinishPrefetch();
+  };
+}
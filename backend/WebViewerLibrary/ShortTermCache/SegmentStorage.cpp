@@ -0,0 +1,415 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "SegmentStorage.h"
+#include "CacheReaper.h"
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+  static const char* const ADDRESS_PREFIX = "seg:";
+  static const char* const SEGMENT_PREFIX = "segment-";
+  static const char* const SEGMENT_EXTENSION = ".dat";
+
+  // A new segment is started once the current one reaches this size
+  static const uint64_t MAX_SEGMENT_SIZE = 64 * 1024 * 1024;
+
+  // A sealed segment is compacted once less than this percentage of its
+  // bytes belong to live items
+  static const uint64_t COMPACTION_THRESHOLD_PERCENT = 50;
+
+  // Each item is preceded by a magic number and its length, so that the
+  // recovery can detect the items that were not completely written
+  static const uint32_t RECORD_MAGIC = 0x5357564f;
+  static const size_t HEADER_SIZE = 8;
+
+  void EncodeHeader(uint8_t* header,
+                    uint32_t length)
+  {
+    for (size_t i = 0; i < 4; i++)
+    {
+      header[i] = static_cast<uint8_t>(RECORD_MAGIC >> (8 * i));
+      header[i + 4] = static_cast<uint8_t>(length >> (8 * i));
+    }
+  }
+
+  bool CheckHeader(const uint8_t* header,
+                   uint64_t length)
+  {
+    uint8_t expected[HEADER_SIZE];
+    EncodeHeader(expected, static_cast<uint32_t>(length));
+    return std::equal(expected, expected + HEADER_SIZE, header);
+  }
+
+  class FileReader : public boost::noncopyable
+  {
+  private:
+    FILE*  file_;
+
+  public:
+    explicit FileReader(const boost::filesystem::path& path)
+    {
+      file_ = fopen(path.string().c_str(), "rb");
+    }
+
+    ~FileReader()
+    {
+      if (file_ != NULL)
+      {
+        fclose(file_);
+      }
+    }
+
+    bool Read(void* target,
+              uint64_t offset,
+              size_t size)
+    {
+      return (file_ != NULL &&
+              fseek(file_, static_cast<long>(offset), SEEK_SET) == 0 &&
+              fread(target, 1, size, file_) == size);
+    }
+  };
+}
+
+
+namespace OrthancPlugins
+{
+  boost::filesystem::path SegmentStorage::GetPath(uint32_t segment) const
+  {
+    return root_ / (SEGMENT_PREFIX + boost::lexical_cast<std::string>(segment) + SEGMENT_EXTENSION);
+  }
+
+
+  void SegmentStorage::OpenNewSegment()
+  {
+    if (output_ != NULL)
+    {
+      fclose(output_);
+      output_ = NULL;
+    }
+
+    if (!segments_.empty())
+    {
+      current_ = segments_.rbegin()->first + 1;
+    }
+
+    output_ = fopen(GetPath(current_).string().c_str(), "wb");
+    if (output_ == NULL)
+    {
+      throw std::runtime_error("Cannot create a segment of the cache: " + GetPath(current_).string());
+    }
+
+    Segment& segment = segments_[current_];
+    segment.size_ = 0;
+    segment.live_ = 0;
+  }
+
+
+  bool SegmentStorage::ParseAddress(uint32_t& segment,
+                                    uint64_t& offset,
+                                    uint64_t& length,
+                                    const std::string& address)
+  {
+    if (!IsSegmentAddress(address))
+    {
+      return false;
+    }
+
+    const std::string location = address.substr(strlen(ADDRESS_PREFIX));
+
+    std::vector<std::string> tokens;
+    boost::split(tokens, location, boost::is_any_of(":"));
+
+    if (tokens.size() != 3)
+    {
+      return false;
+    }
+
+    try
+    {
+      segment = boost::lexical_cast<uint32_t>(tokens[0]);
+      offset = boost::lexical_cast<uint64_t>(tokens[1]);
+      length = boost::lexical_cast<uint64_t>(tokens[2]);
+      return true;
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      return false;
+    }
+  }
+
+
+  SegmentStorage::SegmentStorage(const boost::filesystem::path& root) :
+    root_(root),
+    current_(0),
+    output_(NULL),
+    reaper_(NULL)
+  {
+    boost::filesystem::create_directories(root_);
+
+    // The segments of the previous run are sealed, their live items are
+    // accounted by Recover()
+    boost::filesystem::directory_iterator end;
+    for (boost::filesystem::directory_iterator it(root_); it != end; ++it)
+    {
+      const std::string name = it->path().filename().string();
+
+      if (boost::filesystem::is_regular_file(it->status()) &&
+          boost::starts_with(name, SEGMENT_PREFIX) &&
+          boost::ends_with(name, SEGMENT_EXTENSION))
+      {
+        try
+        {
+          uint32_t index = boost::lexical_cast<uint32_t>(
+            name.substr(strlen(SEGMENT_PREFIX), name.size() - strlen(SEGMENT_PREFIX) - strlen(SEGMENT_EXTENSION)));
+
+          Segment& segment = segments_[index];
+          segment.size_ = boost::filesystem::file_size(it->path());
+          segment.live_ = 0;
+        }
+        catch (boost::bad_lexical_cast&)
+        {
+          // Not created by the cache, leave it untouched
+        }
+      }
+    }
+
+    // Never append to a segment whose end might have been torn by a crash
+    OpenNewSegment();
+  }
+
+
+  SegmentStorage::~SegmentStorage()
+  {
+    if (output_ != NULL)
+    {
+      fclose(output_);
+    }
+  }
+
+
+  void SegmentStorage::SetReaper(CacheReaper& reaper)
+  {
+    reaper_ = &reaper;
+  }
+
+
+  void SegmentStorage::LocateContent(std::string& path,
+                                     uint64_t& offset,
+                                     uint64_t& length,
+                                     const std::string& address) const
+  {
+    uint32_t segment;
+    if (!ParseAddress(segment, offset, length, address))
+    {
+      throw std::runtime_error("Bad address in the cache: " + address);
+    }
+
+    path = GetPath(segment).string();
+    offset += HEADER_SIZE;
+  }
+
+
+  bool SegmentStorage::IsSegmentAddress(const std::string& address)
+  {
+    return boost::starts_with(address, ADDRESS_PREFIX);
+  }
+
+
+  std::string SegmentStorage::Append(const void* data,
+                                     size_t size)
+  {
+    if (static_cast<uint64_t>(size) > 0xffffffffu)
+    {
+      throw std::runtime_error("Item too large for a segment of the cache");
+    }
+
+    if (segments_[current_].size_ > 0 &&
+        segments_[current_].size_ + HEADER_SIZE + size > MAX_SEGMENT_SIZE)
+    {
+      OpenNewSegment();
+    }
+
+    Segment& segment = segments_[current_];
+
+    uint8_t header[HEADER_SIZE];
+    EncodeHeader(header, static_cast<uint32_t>(size));
+
+    if (fwrite(header, 1, HEADER_SIZE, output_) != HEADER_SIZE ||
+        (size > 0 && fwrite(data, 1, size, output_) != size) ||
+        fflush(output_) != 0)
+    {
+      // The end of this segment is unknown, seal it
+      segment.size_ = MAX_SEGMENT_SIZE;
+      OpenNewSegment();
+      throw std::runtime_error("Cannot write to a segment of the cache");
+    }
+
+    const uint64_t offset = segment.size_;
+    segment.size_ += HEADER_SIZE + size;
+    segment.live_ += HEADER_SIZE + size;
+
+    return (ADDRESS_PREFIX + boost::lexical_cast<std::string>(current_) + ":" +
+            boost::lexical_cast<std::string>(offset) + ":" +
+            boost::lexical_cast<std::string>(size));
+  }
+
+
+  void SegmentStorage::Read(std::string& content,
+                            const std::string& address) const
+  {
+    uint32_t segment;
+    uint64_t offset, length;
+    if (!ParseAddress(segment, offset, length, address))
+    {
+      throw std::runtime_error("Bad address in the cache: " + address);
+    }
+
+    FileReader reader(GetPath(segment));
+
+    uint8_t header[HEADER_SIZE];
+    if (!reader.Read(header, offset, HEADER_SIZE) ||
+        !CheckHeader(header, length))
+    {
+      throw std::runtime_error("Error in the filesystem");
+    }
+
+    content.resize(length);
+    if (length > 0 &&
+        !reader.Read(&content[0], offset + HEADER_SIZE, length))
+    {
+      throw std::runtime_error("Error in the filesystem");
+    }
+  }
+
+
+  void SegmentStorage::Remove(const std::string& address)
+  {
+    uint32_t segment;
+    uint64_t offset, length;
+    if (ParseAddress(segment, offset, length, address))
+    {
+      Segments::iterator found = segments_.find(segment);
+      if (found != segments_.end())
+      {
+        found->second.live_ -= std::min(found->second.live_, HEADER_SIZE + length);
+      }
+    }
+  }
+
+
+  bool SegmentStorage::Recover(const std::string& address)
+  {
+    uint32_t segment;
+    uint64_t offset, length;
+    if (!ParseAddress(segment, offset, length, address))
+    {
+      return false;
+    }
+
+    Segments::iterator found = segments_.find(segment);
+    if (found == segments_.end() ||
+        found->first == current_ ||
+        offset + HEADER_SIZE + length > found->second.size_)
+    {
+      return false;
+    }
+
+    uint8_t header[HEADER_SIZE];
+    FileReader reader(GetPath(segment));
+    if (!reader.Read(header, offset, HEADER_SIZE) ||
+        !CheckHeader(header, length))
+    {
+      return false;
+    }
+
+    found->second.live_ += HEADER_SIZE + length;
+    return true;
+  }
+
+
+  void SegmentStorage::RemoveDeadSegments()
+  {
+    Segments::iterator it = segments_.begin();
+    while (it != segments_.end())
+    {
+      if (it->first != current_ &&
+          it->second.live_ == 0)
+      {
+        if (reaper_ != NULL)
+        {
+          reaper_->RemovePath(GetPath(it->first));
+        }
+        else
+        {
+          boost::system::error_code error;
+          boost::filesystem::remove(GetPath(it->first), error);
+        }
+
+        segments_.erase(it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+
+
+  bool SegmentStorage::LookupCompactionCandidate(uint32_t& segment) const
+  {
+    bool found = false;
+    double best = 1.0;
+
+    for (Segments::const_iterator it = segments_.begin(); it != segments_.end(); ++it)
+    {
+      if (it->first != current_ &&
+          it->second.size_ > 0 &&
+          it->second.live_ > 0 &&
+          it->second.live_ * 100 < it->second.size_ * COMPACTION_THRESHOLD_PERCENT)
+      {
+        double ratio = static_cast<double>(it->second.live_) / static_cast<double>(it->second.size_);
+        if (!found || ratio < best)
+        {
+          found = true;
+          best = ratio;
+          segment = it->first;
+        }
+      }
+    }
+
+    return found;
+  }
+
+
+  std::string SegmentStorage::GetAddressPrefix(uint32_t segment)
+  {
+    return ADDRESS_PREFIX + boost::lexical_cast<std::string>(segment) + ":";
+  }
+}
@@ -0,0 +1,115 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/filesystem.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+namespace OrthancPlugins
+{
+  class CacheReaper;
+
+  // Append-only storage that packs many cached items into a few large
+  // segment files, instead of creating one file per item. An item is
+  // identified by an address "seg:{segment}:{offset}:{length}" that is
+  // stored in the "fileUuid" column of the cache, in place of a UUID.
+  // Removing an item only marks its bytes as dead: the segments that
+  // are mostly dead are compacted by the CacheManager.
+  //
+  // This class is not thread-safe, it is protected by the mutex of the
+  // shard that owns it.
+  class SegmentStorage : public boost::noncopyable
+  {
+  private:
+    struct Segment
+    {
+      uint64_t  size_;
+      uint64_t  live_;
+    };
+
+    typedef std::map<uint32_t, Segment>  Segments;
+
+    boost::filesystem::path  root_;
+    Segments                 segments_;
+    uint32_t                 current_;
+    FILE*                    output_;
+    CacheReaper*             reaper_;
+
+    boost::filesystem::path GetPath(uint32_t segment) const;
+
+    void OpenNewSegment();
+
+    static bool ParseAddress(uint32_t& segment,
+                             uint64_t& offset,
+                             uint64_t& length,
+                             const std::string& address);
+
+  public:
+    explicit SegmentStorage(const boost::filesystem::path& root);
+
+    ~SegmentStorage();
+
+    // Delegates the removal of the dead segments to a background thread,
+    // that defers it while a segment is mapped in memory
+    void SetReaper(CacheReaper& reaper);
+
+    static bool IsSegmentAddress(const std::string& address);
+
+    // Gives the location of the content of an item, so that it can be
+    // mapped in memory. The path is the key to pin the segment.
+    void LocateContent(std::string& path,
+                       uint64_t& offset,
+                       uint64_t& length,
+                       const std::string& address) const;
+
+    // Returns the address of the new item
+    std::string Append(const void* data,
+                       size_t size);
+
+    // Only reads the file of the segment: a sealed segment can be read
+    // without the mutex of the shard, as long as it is pinned
+    void Read(std::string& content,
+              const std::string& address) const;
+
+    void Remove(const std::string& address);
+
+    // Used at startup for each address found in the index: checks that
+    // the item survived the last shutdown, and counts it as live
+    bool Recover(const std::string& address);
+
+    // Deletes the sealed segments that have no live item anymore
+    void RemoveDeadSegments();
+
+    // Lookup a sealed segment whose live items should be moved, so that
+    // its disk space can be reclaimed. The segments without any live item
+    // are left to RemoveDeadSegments().
+    bool LookupCompactionCandidate(uint32_t& segment) const;
+
+    // Common prefix of the addresses of the items of this segment
+    static std::string GetAddressPrefix(uint32_t segment);
+  };
+}
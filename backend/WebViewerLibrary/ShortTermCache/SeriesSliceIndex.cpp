@@ -0,0 +1,76 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "SeriesSliceIndex.h"
+
+#include "Core/OrthancException.h"
+
+#include <json/reader.h>
+#include <json/value.h>
+
+namespace OrthancPlugins
+{
+  SeriesSliceIndex::SeriesSliceIndex(const std::string& seriesContent) :
+    slices_(new PrefetchRange::Slices)
+  {
+    Json::Value json;
+    Json::Reader reader;
+    if (!reader.parse(seriesContent, json) ||
+        json.type() != Json::objectValue ||
+        !json.isMember("ID") ||
+        !json.isMember("Slices") ||
+        json["Slices"].type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    seriesId_ = json["ID"].asString();
+
+    const Json::Value& slices = json["Slices"];
+    slices_->reserve(slices.size());
+    positions_.rehash(slices.size());
+
+    for (Json::Value::ArrayIndex i = 0; i < slices.size(); i++)
+    {
+      slices_->push_back(slices[i].asString());
+
+      // The first occurrence wins, as the former linear search did
+      positions_.insert(std::make_pair(slices_->back(), static_cast<size_t>(i)));
+    }
+  }
+
+
+  bool SeriesSliceIndex::LookupPosition(size_t& position,
+                                        const std::string& slice) const
+  {
+    Positions::const_iterator found = positions_.find(slice);
+
+    if (found == positions_.end())
+    {
+      return false;
+    }
+    else
+    {
+      position = found->second;
+      return true;
+    }
+  }
+}
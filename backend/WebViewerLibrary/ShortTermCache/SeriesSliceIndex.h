@@ -0,0 +1,66 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "PrefetchBatch.h"
+
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace OrthancPlugins
+{
+  // Compact model of the slices of a series, built once from the JSON
+  // of its series information: the ordered slices "{instance}/{frame}"
+  // and the position of each of them
+  class SeriesSliceIndex : public boost::noncopyable
+  {
+  private:
+    typedef boost::unordered_map<std::string, size_t>  Positions;
+
+    std::string                                 seriesId_;
+    boost::shared_ptr<PrefetchRange::Slices>    slices_;
+    Positions                                   positions_;
+
+  public:
+    // Throws if the content is not the information about a series
+    explicit SeriesSliceIndex(const std::string& seriesContent);
+
+    const std::string& GetSeriesId() const
+    {
+      return seriesId_;
+    }
+
+    // Shared with the prefetch ranges of this series
+    boost::shared_ptr<const PrefetchRange::Slices> GetSlices() const
+    {
+      return slices_;
+    }
+
+    size_t GetSize() const
+    {
+      return slices_->size();
+    }
+
+    bool LookupPosition(size_t& position,
+                        const std::string& slice) const;
+  };
+}
@@ -0,0 +1,560 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ShardedCacheManager.h"
+#include "SegmentStorage.h"
+
+#include <boost/interprocess/exceptions.hpp>
+
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <cassert>
+#include <cstring>
+
+namespace
+{
+  static const char* const SHARD_PREFIX = "shard-";
+  static const char* const DATABASE_NAME = "cache.db";
+  static const char* const SEGMENTS_FOLDER = "segments";
+
+  // Below this size, reading an item is cheaper than mapping it
+  static const uint64_t MAPPING_THRESHOLD = 256 * 1024;
+}
+
+
+namespace OrthancPlugins
+{
+  class ShardedCacheManager::Shard : public boost::noncopyable
+  {
+  private:
+    boost::mutex                 mutex_;
+    boost::filesystem::path      root_;
+    CacheReaper&                 reaper_;
+    Orthanc::FilesystemStorage   storage_;
+    Orthanc::SQLite::Connection  db_;
+    SegmentStorage               segments_;
+    std::auto_ptr<CacheManager>  manager_;   // Declared last, as it must be deleted before the database is closed
+
+  public:
+    Shard(OrthancPluginContext* context,
+          CacheReaper& reaper,
+          const boost::filesystem::path& root) :
+      root_(root),
+      reaper_(reaper),
+      storage_(root.string()),
+      segments_(root / SEGMENTS_FOLDER)
+    {
+      segments_.SetReaper(reaper);
+
+      db_.Open((root / DATABASE_NAME).string());
+      manager_.reset(new CacheManager(context, db_, storage_));
+      manager_->SetReaper(reaper);
+      manager_->SetSegmentStorage(segments_);
+    }
+
+    boost::mutex& GetMutex()
+    {
+      return mutex_;
+    }
+
+    CacheManager& GetManager()
+    {
+      return *manager_;
+    }
+
+    // Moves some live items out of the most fragmented segment. Must be
+    // called with the mutex unlocked: it is only locked to list the items
+    // and to append them, and the segment is pinned while it is read.
+    void CompactSegments()
+    {
+      std::vector<CacheManager::CompactionItem> items;
+      std::auto_ptr<CacheReaper::Pin> pin;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (!manager_->PrepareCompaction(items))
+        {
+          return;
+        }
+
+        // All the items belong to the same sealed segment
+        std::string path;
+        uint64_t offset, length;
+        segments_.LocateContent(path, offset, length, items.front().address_);
+        pin.reset(new CacheReaper::Pin(reaper_, path));
+      }
+
+      std::vector<std::string> contents(items.size());
+      for (size_t i = 0; i < items.size(); i++)
+      {
+        segments_.Read(contents[i], items[i].address_);
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+      manager_->CommitCompaction(items, contents);
+    }
+
+    // Must be called with the mutex locked. The large items are mapped
+    // in memory instead of being copied.
+    bool Access(CacheBufferPtr& content,
+                int bundle,
+                const std::string& item)
+    {
+      std::string uuid;
+      uint64_t size;
+      if (!manager_->Locate(uuid, size, bundle, item))
+      {
+        return false;
+      }
+
+      if (size >= MAPPING_THRESHOLD)
+      {
+        std::string path;
+        uint64_t offset;
+
+        if (SegmentStorage::IsSegmentAddress(uuid))
+        {
+          segments_.LocateContent(path, offset, size, uuid);
+        }
+        else
+        {
+          // Same layout as Orthanc::FilesystemStorage, whose GetPath() is private
+          path = (root_ / uuid.substr(0, 2) / uuid.substr(2, 2) / uuid).string();
+          offset = 0;
+        }
+
+        try
+        {
+          // The pin is taken while the mutex is locked, hence before the
+          // file can be handed to the reaper
+          std::auto_ptr<CacheReaper::Pin> pin(new CacheReaper::Pin(reaper_, SegmentStorage::IsSegmentAddress(uuid) ? path : uuid));
+          content.reset(new MappedCacheBuffer(pin.release(), path, offset, static_cast<size_t>(size)));
+          return true;
+        }
+        catch (boost::interprocess::interprocess_exception&)
+        {
+          // Fallback to a plain read
+        }
+      }
+
+      std::string buffer;
+      if (!manager_->Access(buffer, bundle, item))
+      {
+        return false;
+      }
+
+      content.reset(new StringCacheBuffer(buffer));
+      return true;
+    }
+  };
+
+
+  static uint32_t HashResource(const std::string& item)
+  {
+    // FNV-1a over the first component of the item (i.e. the instance or
+    // the series), so that all the items of one resource share a
+    // shard. A hand-written hash is used instead of boost::hash, as the
+    // result is persisted on the disk and must not depend on the version
+    // of Boost.
+    uint32_t hash = 2166136261u;
+
+    for (std::string::const_iterator it = item.begin(); it != item.end() && *it != '/'; ++it)
+    {
+      hash ^= static_cast<uint8_t>(*it);
+      hash *= 16777619u;
+    }
+
+    return hash;
+  }
+
+
+  void ShardedCacheManager::RemoveFormerLayouts(const boost::filesystem::path& root)
+  {
+    // The location of an item depends on the number of shards: drop the
+    // content that was written with another number of shards, as it
+    // would never be reached again
+    if (shards_.size() > 1 &&
+        boost::filesystem::exists(root / DATABASE_NAME))
+    {
+      {
+        Orthanc::FilesystemStorage storage(root.string());
+        Orthanc::SQLite::Connection db;
+        db.Open((root / DATABASE_NAME).string());
+        CacheManager(context_, db, storage).Clear();
+      }
+
+      boost::filesystem::remove(root / DATABASE_NAME);
+      boost::filesystem::remove(root / (std::string(DATABASE_NAME) + "-journal"));
+    }
+
+    if (shards_.size() > 1)
+    {
+      boost::filesystem::remove_all(root / SEGMENTS_FOLDER);
+    }
+
+    boost::filesystem::directory_iterator end;
+    for (boost::filesystem::directory_iterator it(root); it != end; ++it)
+    {
+      const std::string name = it->path().filename().string();
+
+      if (boost::filesystem::is_directory(it->status()) &&
+          boost::starts_with(name, SHARD_PREFIX))
+      {
+        bool obsolete = (shards_.size() == 1);
+
+        if (!obsolete)
+        {
+          try
+          {
+            obsolete = (boost::lexical_cast<size_t>(name.substr(strlen(SHARD_PREFIX))) >= shards_.size());
+          }
+          catch (boost::bad_lexical_cast&)
+          {
+            // Not created by the cache, leave it untouched
+          }
+        }
+
+        if (obsolete)
+        {
+          boost::filesystem::remove_all(it->path());
+        }
+      }
+    }
+  }
+
+
+  void ShardedCacheManager::EvictionThread(ShardedCacheManager* that)
+  {
+    for (;;)
+    {
+      {
+        boost::mutex::scoped_lock lock(that->evictionMutex_);
+        if (!that->evictionSignaled_ &&
+            !that->done_)
+        {
+          that->evictionNeeded_.timed_wait(lock, boost::posix_time::seconds(1));
+        }
+
+        if (that->done_)
+        {
+          return;
+        }
+
+        that->evictionSignaled_ = false;
+      }
+
+      for (size_t i = 0; i < that->shards_.size() && !that->IsDone(); i++)
+      {
+        try
+        {
+          Shard& shard = *that->shards_[i];
+
+          {
+            boost::mutex::scoped_lock lock(shard.GetMutex());
+
+            if (shard.GetManager().IsQuotaExceeded())
+            {
+              shard.GetManager().EnsureQuotas();
+            }
+          }
+
+          shard.CompactSegments();
+        }
+        catch (...)
+        {
+          OrthancPluginLogError(that->context_, "Error while evicting items from the cache of the Web viewer");
+        }
+      }
+    }
+  }
+
+
+  bool ShardedCacheManager::IsDone()
+  {
+    boost::mutex::scoped_lock lock(evictionMutex_);
+    return done_;
+  }
+
+
+  void ShardedCacheManager::SignalEviction()
+  {
+    boost::mutex::scoped_lock lock(evictionMutex_);
+    evictionSignaled_ = true;
+    evictionNeeded_.notify_one();
+  }
+
+
+  void ShardedCacheManager::StopEvictionThread()
+  {
+    {
+      boost::mutex::scoped_lock lock(evictionMutex_);
+      done_ = true;
+      evictionNeeded_.notify_one();
+    }
+
+    if (evictionThread_.joinable())
+    {
+      evictionThread_.join();
+    }
+  }
+
+
+  ShardedCacheManager::Shard& ShardedCacheManager::GetShard(const std::string& item)
+  {
+    assert(!shards_.empty());
+    return *shards_[HashResource(item) % shards_.size()];
+  }
+
+
+  ShardedCacheManager::ShardedCacheManager(OrthancPluginContext* context,
+                                           const std::string& path,
+                                           size_t shardsCount) :
+    context_(context),
+    reaper_(new CacheReaper(context)),
+    evictionSignaled_(false),
+    done_(false)
+  {
+    if (shardsCount == 0)
+    {
+      shardsCount = 1;
+    }
+
+    const boost::filesystem::path root(path);
+    boost::filesystem::create_directories(root);
+
+    try
+    {
+      if (shardsCount == 1)
+      {
+        shards_.push_back(new Shard(context_, *reaper_, root));
+      }
+      else
+      {
+        for (size_t i = 0; i < shardsCount; i++)
+        {
+          shards_.push_back(new Shard(context_, *reaper_, root / (SHARD_PREFIX + boost::lexical_cast<std::string>(i))));
+        }
+      }
+
+      RemoveFormerLayouts(root);
+
+      evictionThread_ = boost::thread(EvictionThread, this);
+    }
+    catch (...)
+    {
+      reaper_.reset(NULL);
+
+      for (size_t i = 0; i < shards_.size(); i++)
+      {
+        delete shards_[i];
+      }
+
+      throw;
+    }
+  }
+
+
+  ShardedCacheManager::~ShardedCacheManager()
+  {
+    StopEvictionThread();
+
+    // Finish the pending removals while the storages still exist
+    reaper_.reset(NULL);
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      delete shards_[i];
+    }
+  }
+
+
+  void ShardedCacheManager::Clear()
+  {
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      boost::mutex::scoped_lock lock(shards_[i]->GetMutex());
+      shards_[i]->GetManager().Clear();
+    }
+  }
+
+
+  void ShardedCacheManager::SetSegmentStorageEnabled(int bundle,
+                                                     bool enabled)
+  {
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      boost::mutex::scoped_lock lock(shards_[i]->GetMutex());
+      shards_[i]->GetManager().SetSegmentStorageEnabled(bundle, enabled);
+    }
+  }
+
+
+  void ShardedCacheManager::SetBundleQuota(int bundle,
+                                           uint32_t maxCount,
+                                           uint64_t maxSpace,
+                                           CacheEvictionPolicy policy)
+  {
+    // Each shard gets an even part of the global quota (rounded up, so
+    // that a non-zero quota never becomes zero)
+    const size_t n = shards_.size();
+    const uint32_t shardCount = static_cast<uint32_t>((maxCount + n - 1) / n);
+    const uint64_t shardSpace = (maxSpace + n - 1) / n;
+
+    for (size_t i = 0; i < n; i++)
+    {
+      boost::mutex::scoped_lock lock(shards_[i]->GetMutex());
+      shards_[i]->GetManager().SetBundleQuota(bundle, shardCount, shardSpace, policy);
+    }
+  }
+
+
+  bool ShardedCacheManager::IsCached(int bundle,
+                                     const std::string& item)
+  {
+    Shard& shard = GetShard(item);
+    boost::mutex::scoped_lock lock(shard.GetMutex());
+    return shard.GetManager().IsCached(bundle, item);
+  }
+
+
+  bool ShardedCacheManager::Access(std::string& content,
+                                   int bundle,
+                                   const std::string& item)
+  {
+    Shard& shard = GetShard(item);
+    boost::mutex::scoped_lock lock(shard.GetMutex());
+    return shard.GetManager().Access(content, bundle, item);
+  }
+
+
+  bool ShardedCacheManager::Access(CacheBufferPtr& content,
+                                   int bundle,
+                                   const std::string& item)
+  {
+    Shard& shard = GetShard(item);
+    boost::mutex::scoped_lock lock(shard.GetMutex());
+    return shard.Access(content, bundle, item);
+  }
+
+
+  void ShardedCacheManager::Invalidate(int bundle,
+                                       const std::string& itemPrefix)
+  {
+    // The prefixes always start with a whole resource identifier (an
+    // instance or a series), whose items all live in the same shard
+    Shard& shard = GetShard(itemPrefix);
+    boost::mutex::scoped_lock lock(shard.GetMutex());
+    shard.GetManager().Invalidate(bundle, itemPrefix);
+  }
+
+
+  void ShardedCacheManager::GetMostRecentItems(std::vector<std::string>& items,
+                                               int bundle,
+                                               uint64_t maxSpace)
+  {
+    const size_t n = shards_.size();
+    const uint64_t shardSpace = (maxSpace + n - 1) / n;
+
+    std::vector< std::vector<std::string> > shardItems(n);
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+      boost::mutex::scoped_lock lock(shards_[i]->GetMutex());
+      shards_[i]->GetManager().GetMostRecentItems(shardItems[i], bundle, shardSpace);
+      count += shardItems[i].size();
+    }
+
+    // The sequences of the shards are independent: interleave their
+    // lists, so that each shard keeps its own order
+    items.clear();
+    items.reserve(count);
+
+    for (size_t rank = 0; items.size() < count; rank++)
+    {
+      for (size_t i = 0; i < n; i++)
+      {
+        if (rank < shardItems[i].size())
+        {
+          items.push_back(shardItems[i][rank]);
+        }
+      }
+    }
+  }
+
+
+  void ShardedCacheManager::Store(int bundle,
+                                  const std::string& item,
+                                  const std::string& content,
+                                  uint32_t cost)
+  {
+    Shard& shard = GetShard(item);
+    boost::mutex::scoped_lock lock(shard.GetMutex());
+    shard.GetManager().Store(bundle, item, content, cost);
+
+    if (shard.GetManager().IsQuotaExceeded())
+    {
+      SignalEviction();
+    }
+  }
+
+
+  void ShardedCacheManager::StoreBatch(int bundle,
+                                       const std::vector<std::string>& items,
+                                       const std::vector<const std::string*>& contents,
+                                       const std::vector<uint32_t>& costs)
+  {
+    if (items.empty())
+    {
+      return;
+    }
+
+    // The items of a batch share the same resource identifier, and thus
+    // the same shard
+    Shard& shard = GetShard(items[0]);
+    boost::mutex::scoped_lock lock(shard.GetMutex());
+    shard.GetManager().StoreBatch(bundle, items, contents, costs);
+
+    if (shard.GetManager().IsQuotaExceeded())
+    {
+      SignalEviction();
+    }
+  }
+
+
+  void ShardedCacheManager::SetProperty(CacheProperty property,
+                                        const std::string& value)
+  {
+    // The global properties are stored in the first shard
+    boost::mutex::scoped_lock lock(shards_[0]->GetMutex());
+    shards_[0]->GetManager().SetProperty(property, value);
+  }
+
+
+  bool ShardedCacheManager::LookupProperty(std::string& target,
+                                           CacheProperty property)
+  {
+    boost::mutex::scoped_lock lock(shards_[0]->GetMutex());
+    return shards_[0]->GetManager().LookupProperty(target, property);
+  }
+}
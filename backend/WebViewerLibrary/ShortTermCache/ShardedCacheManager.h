@@ -0,0 +1,142 @@
+/**
+ * Orthanc - A Lightweight, RESTful DICOM Store
+ * Copyright (C) 2012-2016 Sebastien Jodogne, Medical Physics
+ * Department, University Hospital of Liege, Belgium
+ * Copyright (C) 2017 Osimis, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "CacheBuffer.h"
+#include "CacheManager.h"
+#include "CacheReaper.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  // Spreads the cached items over N independent CacheManager, each one
+  // with its own SQLite index, storage subdirectory and mutex. All the
+  // items that share the same resource (i.e. "{instance}/..." or
+  // "{series}") belong to the same shard, so that invalidating a prefix
+  // only locks one shard. The quotas are split evenly between the shards,
+  // which enforces the global quotas approximately. The bundles can
+  // temporarily grow above their quota, until the eviction thread
+  // brings them back below their low watermark. The same thread
+  // compacts the segment storages.
+  //
+  // Contrarily to CacheManager, this class is thread-safe.
+  class ShardedCacheManager : public boost::noncopyable
+  {
+  private:
+    class Shard;
+
+    OrthancPluginContext*       context_;
+    std::auto_ptr<CacheReaper>  reaper_;   // Shared by all the shards
+    std::vector<Shard*>         shards_;
+
+    // The evictions are done by a background thread, so that Store()
+    // never pays for them
+    boost::mutex                evictionMutex_;
+    boost::condition_variable   evictionNeeded_;
+    bool                        evictionSignaled_;
+    bool                        done_;   // Protected by evictionMutex_
+    boost::thread               evictionThread_;
+
+    static void EvictionThread(ShardedCacheManager* that);
+
+    bool IsDone();
+
+    void SignalEviction();
+
+    void StopEvictionThread();
+
+    void RemoveFormerLayouts(const boost::filesystem::path& root);
+
+    Shard& GetShard(const std::string& item);
+
+  public:
+    // With a single shard, the cache keeps the historical layout (i.e. a
+    // single "cache.db" at the root of "path")
+    ShardedCacheManager(OrthancPluginContext* context,
+                        const std::string& path,
+                        size_t shardsCount);
+
+    ~ShardedCacheManager();
+
+    OrthancPluginContext* GetPluginContext() const
+    {
+      return context_;
+    }
+
+    size_t GetShardsCount() const
+    {
+      return shards_.size();
+    }
+
+    void Clear();
+
+    void SetSegmentStorageEnabled(int bundle,
+                                  bool enabled);
+
+    void SetBundleQuota(int bundle,
+                        uint32_t maxCount,
+                        uint64_t maxSpace,
+                        CacheEvictionPolicy policy = CacheEvictionPolicy_LeastRecentlyUsed);
+
+    bool IsCached(int bundle,
+                  const std::string& item);
+
+    bool Access(std::string& content,
+                int bundle,
+                const std::string& item);
+
+    // Same as above, but maps the large items in memory instead of
+    // reading them
+    bool Access(CacheBufferPtr& content,
+                int bundle,
+                const std::string& item);
+
+    void Invalidate(int bundle,
+                    const std::string& itemPrefix);
+
+    // Lists the most recently used items of the bundle across all the
+    // shards, the most recent ones first, within a total of "maxSpace"
+    void GetMostRecentItems(std::vector<std::string>& items,
+                            int bundle,
+                            uint64_t maxSpace);
+
+    void Store(int bundle,
+               const std::string& item,
+               const std::string& content,
+               uint32_t cost);
+
+    // All the items must start with the same resource identifier
+    void StoreBatch(int bundle,
+                    const std::vector<std::string>& items,
+                    const std::vector<const std::string*>& contents,
+                    const std::vector<uint32_t>& costs);
+
+    void SetProperty(CacheProperty property,
+                     const std::string& value);
+
+    bool LookupProperty(std::string& target,
+                        CacheProperty property);
+  };
+}
@@ -25,62 +25,345 @@
 #include "CacheScheduler.h"
 
 #include <json/value.h>
-#include <json/reader.h>
 #include "Image/ImageController.h"
 #include <algorithm>
+#include <cmath>
 #include "Series/SeriesRepository.h"
 
-static const Json::Value::ArrayIndex PREFETCH_FORWARD = 10;
-static const Json::Value::ArrayIndex PREFETCH_BACKWARD = 3;
+// Default window: slices prefetched ahead of the displayed one (at
+// least, and at most when scrolling fast) and behind it
+static const unsigned int PREFETCH_MIN_FORWARD = 10;
+static const unsigned int PREFETCH_MAX_FORWARD = 100;
+static const unsigned int PREFETCH_BACKWARD = 3;
+
+// Number of series whose prefetch window follows the scrolling
+static const size_t MAX_FRONTIERS = 32;
+
+// Beyond this delay between two slices, the user has stopped scrolling
+static const double MAX_SCROLL_PAUSE = 2.0;  // In seconds
+
+// The accesses are observed by the threads of the cache once they are
+// dequeued, which can group them: their interval is bounded below
+static const double MIN_SCROLL_INTERVAL = 0.01;  // In seconds
 
 
 namespace OrthancPlugins
 {
+  ViewerPrefetchPolicy::ViewerPrefetchPolicy(OrthancPluginContext* context, SeriesRepository* seriesRepository) :
+    context_(context),
+    seriesRepository_(seriesRepository),
+    minForward_(PREFETCH_MIN_FORWARD),
+    maxForward_(PREFETCH_MAX_FORWARD),
+    backward_(PREFETCH_BACKWARD),
+    frontiersClock_(0),
+    invalidations_(0)
+  {
+  }
+
 
-  void ViewerPrefetchPolicy::PrefetchSeries(std::list<CacheIndex>& toPrefetch,
-                                            const std::string& seriesContent,
-                                            unsigned int startIndex,
-                                            unsigned int endIndex)
+  void ViewerPrefetchPolicy::SetWindow(unsigned int minForward,
+                                       unsigned int maxForward,
+                                       unsigned int backward)
   {
-    Json::Value json;
-    Json::Reader reader;
-    if (!reader.parse(seriesContent, json) ||
-        !json.isMember("Slices"))
+    minForward_ = std::max(minForward, 1u);
+    maxForward_ = std::max(maxForward, minForward_);
+    backward_ = backward;
+  }
+
+
+  ViewerPrefetchPolicy::Frontier& ViewerPrefetchPolicy::GetFrontier(bool& isNew,
+                                                                    const std::string& seriesId)
+  {
+    Frontiers::iterator found = frontiers_.find(seriesId);
+    isNew = (found == frontiers_.end());
+
+    if (!isNew)
     {
-      return;
+      found->second.lastUse_ = ++frontiersClock_;
+      return found->second;
     }
 
-    const Json::Value& slices = json["Slices"];
-    if (slices.type() != Json::arrayValue)
+    if (frontiers_.size() >= MAX_FRONTIERS)
     {
+      // Forget the series that was scrolled the least recently
+      Frontiers::iterator oldest = frontiers_.begin();
+      for (Frontiers::iterator it = frontiers_.begin(); it != frontiers_.end(); ++it)
+      {
+        if (it->second.lastUse_ < oldest->second.lastUse_)
+        {
+          oldest = it;
+        }
+      }
+
+      frontiers_.erase(oldest);
+    }
+
+    Frontier& frontier = frontiers_[seriesId];
+    frontier.position_ = 0;
+    frontier.ahead_ = minForward_;
+    frontier.forward_ = true;
+    frontier.lastAccess_ = 0;
+    frontier.velocity_ = 0;
+    frontier.lastUse_ = ++frontiersClock_;
+
+    return frontier;
+  }
+
+
+  // Updates the scrolling speed of the user, from the previous access
+  static void ObserveAccess(size_t& lastAccess,
+                            boost::posix_time::ptime& lastTime,
+                            double& velocity,
+                            size_t position)
+  {
+    if (position == lastAccess &&
+        !lastTime.is_not_a_date_time())
+    {
+      // Another quality of the same slice
       return;
     }
 
-    // preload the first frames of the series in all available qualities
-    std::auto_ptr<Series> series = seriesRepository_->GetSeries(json["ID"].asString(), false);
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    if (lastTime.is_not_a_date_time())
+    {
+      velocity = 0;
+    }
+    else
+    {
+      const double elapsed = static_cast<double>((now - lastTime).total_microseconds()) / 1000000.0;
+
+      if (elapsed > MAX_SCROLL_PAUSE)
+      {
+        velocity = 0;
+      }
+      else
+      {
+        const double current = ((static_cast<double>(position) - static_cast<double>(lastAccess)) /
+                                std::max(elapsed, MIN_SCROLL_INTERVAL));
+        velocity = 0.5 * velocity + 0.5 * current;
+      }
+    }
+
+    lastAccess = position;
+    lastTime = now;
+  }
+
+
+  size_t ViewerPrefetchPolicy::GetForwardWindow(double velocity,
+                                                double throughput) const
+  {
+    // The window covers the slices that the user scrolls through while
+    // the minimal window is decoded (within 1 second if the throughput
+    // is not measured yet)
+    const double horizon = (throughput > 0 ? static_cast<double>(minForward_) / throughput : 1.0);
+    const double ahead = std::ceil(std::fabs(velocity) * horizon);
+
+    if (ahead <= static_cast<double>(minForward_))
+    {
+      return minForward_;
+    }
+    else if (ahead >= static_cast<double>(maxForward_))
+    {
+      return maxForward_;
+    }
+    else
+    {
+      return static_cast<size_t>(ahead);
+    }
+  }
+
+
+  void ViewerPrefetchPolicy::MoveWindow(PrefetchBatch& toPrefetch,
+                                        Frontier& frontier,
+                                        const std::string& seriesId,
+                                        size_t position,
+                                        double throughput)
+  {
+    const size_t ahead = GetForwardWindow(frontier.velocity_, throughput);
+    const bool forward = (frontier.velocity_ >= 0);
+
+    size_t begin, end;
+    if (forward)
+    {
+      begin = position - std::min<size_t>(position, backward_);
+      end = position + ahead;
+    }
+    else
+    {
+      // The user scrolls toward the first slices
+      begin = position - std::min<size_t>(position, ahead - 1);
+      end = position + backward_ + 1;
+    }
+
+    frontier.position_ = position;
+    frontier.ahead_ = ahead;
+    frontier.forward_ = forward;
+
+    toPrefetch.AddRange(PrefetchRange(CacheBundle_DecodedImage, frontier.index_->GetSlices(), begin, end, position,
+                                      frontier.qualities_, seriesId, frontier.velocity_ > 0));
+  }
+
+
+  boost::shared_ptr<const SeriesSliceIndex> ViewerPrefetchPolicy::GetSliceIndex(uint64_t& invalidations,
+                                                                                CacheScheduler& cache,
+                                                                                const std::string& seriesId,
+                                                                                const std::string* seriesContent)
+  {
+    {
+      boost::mutex::scoped_lock lock(frontiersMutex_);
+
+      invalidations = invalidations_;
+
+      Frontiers::const_iterator found = frontiers_.find(seriesId);
+      if (found != frontiers_.end() &&
+          found->second.index_.get() != NULL &&
+          seriesContent == NULL)
+      {
+        return found->second.index_;
+      }
+    }
+
+    boost::shared_ptr<const SeriesSliceIndex> index;
+
+    if (seriesContent != NULL)
+    {
+      index.reset(new SeriesSliceIndex(*seriesContent));
+    }
+    else
+    {
+      // The policy runs in the background: this access must neither
+      // pause the prefetching, nor apply the policy once more
+      std::string content;
+      if (!cache.AccessInBackground(content, CacheBundle_SeriesInformation, seriesId))
+      {
+        return index;
+      }
+
+      index.reset(new SeriesSliceIndex(content));
+    }
+
+    return index;
+  }
+
+
+  bool ViewerPrefetchPolicy::FollowFrontier(PrefetchBatch& toPrefetch,
+                                            CacheScheduler& cache,
+                                            const std::string& slice)
+  {
+    const double throughput = cache.GetCreationThroughput(CacheBundle_DecodedImage);
+
+    boost::mutex::scoped_lock lock(frontiersMutex_);
 
-    BOOST_FOREACH(ImageQuality quality, series->GetOrderedImageQualities()) {
+    Frontiers::iterator found = frontiers_.end();
+    size_t position = 0;
 
-      for (Json::Value::ArrayIndex i = std::max(0u, startIndex);
-           i < std::min(slices.size(), endIndex);
-           i++)
+    for (Frontiers::iterator it = frontiers_.begin(); it != frontiers_.end(); ++it)
+    {
+      if (it->second.index_.get() != NULL &&
+          it->second.index_->LookupPosition(position, slice))
       {
-        toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, slices[i].asString() + "/" + quality.toProcessingPolicytString()));
+        found = it;
+        break;
       }
     }
+
+    if (found == frontiers_.end())
+    {
+      return false;
+    }
+
+    Frontier& frontier = found->second;
+    frontier.lastUse_ = ++frontiersClock_;
+    ObserveAccess(frontier.lastAccess_, frontier.lastTime_, frontier.velocity_, position);
+
+    // The window is moved once the user has gone through half of it, or
+    // has changed direction
+    const size_t distance = (position > frontier.position_ ?
+                             position - frontier.position_ :
+                             frontier.position_ - position);
+    const bool forward = (frontier.velocity_ >= 0);
+
+    if (forward == frontier.forward_ &&
+        2 * distance < frontier.ahead_)
+    {
+      return true;
+    }
+
+    // The items of the former window that are already cached or queued
+    // are skipped by the prefetcher, so only the new slices are created
+    MoveWindow(toPrefetch, frontier, found->first, position, throughput);
+
+    return true;
   }
 
 
-  void ViewerPrefetchPolicy::ApplySeries(std::list<CacheIndex>& toPrefetch,
+  void ViewerPrefetchPolicy::PrefetchSeries(PrefetchBatch& toPrefetch,
+                                            CacheScheduler& cache,
+                                            const boost::shared_ptr<const SeriesSliceIndex>& index,
+                                            uint64_t invalidations,
+                                            const std::string& slice)
+  {
+    size_t position = 0;
+    if (!slice.empty() &&
+        !index->LookupPosition(position, slice))
+    {
+      return;
+    }
+
+    // preload the frames of the series in all available qualities
+    const std::string& seriesId = index->GetSeriesId();
+    const SeriesDescriptor series = seriesRepository_->GetSeriesDescriptor(seriesId);
+
+    std::vector<std::string> qualities;
+    BOOST_FOREACH(ImageQuality quality, series.GetOrderedImageQualities()) {
+      qualities.push_back(quality.toProcessingPolicytString());
+    }
+
+    const double throughput = cache.GetCreationThroughput(CacheBundle_DecodedImage);
+
+    boost::mutex::scoped_lock lock(frontiersMutex_);
+
+    bool isNew;
+    Frontier& frontier = GetFrontier(isNew, seriesId);
+    frontier.qualities_ = qualities;
+
+    // The index is only kept if no series information was invalidated
+    // while it was built, as it could be outdated
+    if (invalidations == invalidations_)
+    {
+      frontier.index_ = index;
+    }
+
+    if (!isNew &&
+        slice.empty())
+    {
+      // The user is already scrolling through this series
+      return;
+    }
+
+    if (!slice.empty())
+    {
+      ObserveAccess(frontier.lastAccess_, frontier.lastTime_, frontier.velocity_, position);
+    }
+
+    MoveWindow(toPrefetch, frontier, seriesId, position, throughput);
+  }
+
+
+  void ViewerPrefetchPolicy::ApplySeries(PrefetchBatch& toPrefetch,
                                          CacheScheduler& cache,
                                          const std::string& series,
                                          const std::string& content)
   {
-    PrefetchSeries(toPrefetch, content, 0, PREFETCH_FORWARD);
+    // The series information was just created: its index is rebuilt
+    uint64_t invalidations;
+    boost::shared_ptr<const SeriesSliceIndex> index = GetSliceIndex(invalidations, cache, series, &content);
+    PrefetchSeries(toPrefetch, cache, index, invalidations, "");
   }
 
 
-  void ViewerPrefetchPolicy::ApplyInstance(std::list<CacheIndex>& toPrefetch,
+  void ViewerPrefetchPolicy::ApplyInstance(PrefetchBatch& toPrefetch,
                                            CacheScheduler& cache,
                                            const std::string& path)
   {
@@ -100,47 +383,28 @@ namespace OrthancPlugins
     }
 
     // request the prefetch of all higher qualities in their order of quality
-    std::auto_ptr<Series> series = seriesRepository_->GetSeries(instanceJson["ParentSeries"].asString(), false);
+    const SeriesDescriptor series = seriesRepository_->GetSeriesDescriptor(instanceJson["ParentSeries"].asString());
     // if the current quality is low, start to prefetch the higher quality:
     std::string currentQuality = processingPolicy->ToString();
 
-    BOOST_FOREACH(ImageQuality quality, series->GetOrderedImageQualities(ImageQuality::fromProcessingPolicytString(currentQuality))) {
-      toPrefetch.push_back(CacheIndex(CacheBundle_DecodedImage, slice + "/" + quality.toProcessingPolicytString()));
+    // the displayed slice comes first, hence the ranks of its qualities start at 0
+    unsigned int qualityRank = 0;
+    BOOST_FOREACH(ImageQuality quality, series.GetOrderedImageQualities(ImageQuality::fromProcessingPolicytString(currentQuality))) {
+      toPrefetch.AddItem(CacheIndex(CacheBundle_DecodedImage, slice + "/" + quality.toProcessingPolicytString(), qualityRank, 0,
+                                    instanceJson["ParentSeries"].asString()));
+      qualityRank++;
     }
 
 
-    // get the series information
-    std::string seriesContent;
-    if (!cache.Access(seriesContent, CacheBundle_SeriesInformation, instanceJson["ParentSeries"].asString()))
+    // get the slices of the series, that are only parsed once
+    uint64_t invalidations;
+    boost::shared_ptr<const SeriesSliceIndex> index = GetSliceIndex(invalidations, cache, instanceJson["ParentSeries"].asString(), NULL);
+    if (index.get() == NULL)
     {
       return;
     }
 
-    // find the index of this frame in the series
-    Json::Value json;
-    Json::Reader reader;
-    if (!reader.parse(seriesContent, json) ||
-        !json.isMember("Slices"))
-    {
-      return;
-    }
-
-    const Json::Value& slices = json["Slices"];
-    if (slices.type() != Json::arrayValue)
-      return;
-
-    Json::Value::ArrayIndex position = 0;
-    while (position < slices.size())
-    {
-      if (slices[position] == slice)
-        break;
-
-      position++;
-    }
-
-
-
-    PrefetchSeries(toPrefetch, seriesContent, position - PREFETCH_BACKWARD, position + PREFETCH_FORWARD);
+    PrefetchSeries(toPrefetch, cache, index, invalidations, slice);
 
     //    Json::Value series;
     //    Json::Reader reader;
@@ -191,7 +455,7 @@ namespace OrthancPlugins
   }
 
 
-  void ViewerPrefetchPolicy::Apply(std::list<CacheIndex>& toPrefetch,
+  void ViewerPrefetchPolicy::Apply(PrefetchBatch& toPrefetch,
                                    CacheScheduler& cache,
                                    const CacheIndex& accessed,
                                    const std::string& content)
@@ -210,5 +474,59 @@ namespace OrthancPlugins
       return;
     }
   }
-}
 
+
+  bool ViewerPrefetchPolicy::IsFollowingHits(int bundle) const
+  {
+    return bundle == CacheBundle_DecodedImage;
+  }
+
+
+  void ViewerPrefetchPolicy::ApplyHit(PrefetchBatch& toPrefetch,
+                                      CacheScheduler& cache,
+                                      const CacheIndex& accessed)
+  {
+    if (accessed.GetBundle() != CacheBundle_DecodedImage)
+    {
+      return;
+    }
+
+    // The item is "{instance}/{frame}/{quality}"
+    const std::string& item = accessed.GetItem();
+    size_t separator = item.find('/');
+    if (separator != std::string::npos)
+    {
+      separator = item.find('/', separator + 1);
+    }
+
+    if (separator == std::string::npos)
+    {
+      return;
+    }
+
+    if (!FollowFrontier(toPrefetch, cache, item.substr(0, separator)))
+    {
+      // Slice of a series that is not followed yet
+      ApplyInstance(toPrefetch, cache, item);
+    }
+  }
+
+
+  void ViewerPrefetchPolicy::Invalidate(int bundle,
+                                        const std::string& item)
+  {
+    if (bundle == CacheBundle_SeriesInformation)
+    {
+      boost::mutex::scoped_lock lock(frontiersMutex_);
+
+      invalidations_++;
+
+      Frontiers::iterator found = frontiers_.find(item);
+      if (found != frontiers_.end())
+      {
+        // The scrolling history is kept, the slices are parsed again
+        found->second.index_.reset();
+      }
+    }
+  }
+}
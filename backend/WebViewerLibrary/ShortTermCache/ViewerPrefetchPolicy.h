@@ -22,8 +22,12 @@
 #pragma once
 
 #include "IPrefetchPolicy.h"
+#include "SeriesSliceIndex.h"
 
 #include <orthanc/OrthancCPlugin.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
 class SeriesRepository;
 
 namespace OrthancPlugins
@@ -31,31 +35,96 @@ namespace OrthancPlugins
   class ViewerPrefetchPolicy : public IPrefetchPolicy
   {
   private:
+    // Prefetch window of a series, that follows the scrolling of the user
+    struct Frontier
+    {
+      boost::shared_ptr<const SeriesSliceIndex>       index_;        // NULL once invalidated
+      std::vector<std::string>                        qualities_;
+      size_t                                          position_;     // Center of the last window
+      size_t                                          ahead_;
+      bool                                            forward_;
+      size_t                                          lastAccess_;   // Last displayed slice
+      boost::posix_time::ptime                        lastTime_;
+      double                                          velocity_;     // In slices per second
+      uint64_t                                        lastUse_;
+    };
+
+    typedef std::map<std::string, Frontier>  Frontiers;
+
     OrthancPluginContext* context_;
     SeriesRepository* seriesRepository_;
+    unsigned int minForward_;
+    unsigned int maxForward_;
+    unsigned int backward_;
+    boost::mutex frontiersMutex_;
+    Frontiers frontiers_;
+    uint64_t frontiersClock_;
+    uint64_t invalidations_;
+
+    // The mutex must be locked
+    Frontier& GetFrontier(bool& isNew,
+                          const std::string& seriesId);
+
+    size_t GetForwardWindow(double velocity,
+                            double throughput) const;
+
+    void MoveWindow(PrefetchBatch& toPrefetch,
+                    Frontier& frontier,
+                    const std::string& seriesId,
+                    size_t position,
+                    double throughput);
+
+    // The index of the slices is only built if the series is not known
+    // yet, from the given content or from the cached series information.
+    // "invalidations" allows to check that it is still valid once built.
+    boost::shared_ptr<const SeriesSliceIndex> GetSliceIndex(uint64_t& invalidations,
+                                                            CacheScheduler& cache,
+                                                            const std::string& seriesId,
+                                                            const std::string* seriesContent);
 
-    void ApplySeries(std::list<CacheIndex>& toPrefetch,
+    // Returns "false" if the slice is not in a known series
+    bool FollowFrontier(PrefetchBatch& toPrefetch,
+                        CacheScheduler& cache,
+                        const std::string& slice);
+
+    void ApplySeries(PrefetchBatch& toPrefetch,
                      CacheScheduler& cache,
                      const std::string& series,
                      const std::string& content);
 
-    void ApplyInstance(std::list<CacheIndex>& toPrefetch,
+    void ApplyInstance(PrefetchBatch& toPrefetch,
                        CacheScheduler& cache,
                        const std::string& path);
 
-    void PrefetchSeries(std::list<CacheIndex>& toPrefetch,
-                        const std::string& seriesContent,
-                        unsigned int startIndex,
-                        unsigned int endIndex);
+    // An empty slice stands for the opening of the series
+    void PrefetchSeries(PrefetchBatch& toPrefetch,
+                        CacheScheduler& cache,
+                        const boost::shared_ptr<const SeriesSliceIndex>& index,
+                        uint64_t invalidations,
+                        const std::string& slice);
 
   public:
-    ViewerPrefetchPolicy(OrthancPluginContext* context, SeriesRepository* seriesRepository) : context_(context), seriesRepository_(seriesRepository)
-    {
-    }
+    ViewerPrefetchPolicy(OrthancPluginContext* context, SeriesRepository* seriesRepository);
+
+    // Slices prefetched ahead of the displayed one, depending on the
+    // scrolling speed, and behind it. Must be called before the policy
+    // is registered.
+    void SetWindow(unsigned int minForward,
+                   unsigned int maxForward,
+                   unsigned int backward);
 
-    virtual void Apply(std::list<CacheIndex>& toPrefetch,
+    virtual void Apply(PrefetchBatch& toPrefetch,
                        CacheScheduler& cache,
                        const CacheIndex& accessed,
                        const std::string& content);
+
+    virtual bool IsFollowingHits(int bundle) const;
+
+    virtual void ApplyHit(PrefetchBatch& toPrefetch,
+                          CacheScheduler& cache,
+                          const CacheIndex& accessed);
+
+    virtual void Invalidate(int bundle,
+                            const std::string& item);
   };
 }
@@ -12,15 +12,22 @@
 #include "../Annotation/AnnotationRepository.h"
 #include "../BenchmarkHelper.h" // for BENCH(*)
 #include "../OrthancContextManager.h"
+#include "ShortTermCache/CacheContext.h"
 #include "ViewerToolbox.h"
 
 AnnotationRepository* StudyController::annotationRepository_ = NULL;
+CacheContext* StudyController::cacheContext_ = NULL;
 
 template<>
 void StudyController::Inject<AnnotationRepository>(AnnotationRepository* obj) {
   StudyController::annotationRepository_ = obj;
 }
 
+template<>
+void StudyController::Inject<CacheContext>(CacheContext* obj) {
+  StudyController::cacheContext_ = obj;
+}
+
 StudyController::StudyController(OrthancPluginRestOutput* response, const std::string& url, const OrthancPluginHttpRequest* request)
   : BaseController(response, url, request)
 {
@@ -197,6 +204,11 @@ int StudyController::ProcessStudyInfoRequest(OrthancPluginContext* context)
     studyInfo["Series"].append(seriesDisplayOrder[i]);
   }
 
+  // warm up the cache with the thumbnails of the series, in the order they are displayed
+  if (cacheContext_ != NULL) {
+    cacheContext_->SignalOpenedStudy(this->studyId_, seriesDisplayOrder);
+  }
+
   return this->_AnswerBuffer(studyInfo);
 
 }
@@ -78,7 +78,15 @@ add_library(WebViewerLibrary
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/ICacheFactory.h
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/IPrefetchPolicy.h
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheIndex.h
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheBuffer.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheExecutor.cpp
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheManager.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheReaper.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/MemoryCache.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/PrefetchThrottle.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/ShardedCacheManager.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/SegmentStorage.cpp
+  ${VIEWER_LIBRARY_DIR}/ShortTermCache/SeriesSliceIndex.cpp
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheContext.cpp
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/CacheScheduler.cpp
   ${VIEWER_LIBRARY_DIR}/ShortTermCache/ViewerPrefetchPolicy.cpp
@@ -94,6 +102,7 @@ add_library(WebViewerLibrary
   ${VIEWER_LIBRARY_DIR}/Series/SeriesController.cpp
   ${VIEWER_LIBRARY_DIR}/Image/AvailableQuality/OnTheFlyDownloadAvailableQualityPolicy.cpp
   ${VIEWER_LIBRARY_DIR}/Image/Utilities/KLVWriter.cpp
+  ${VIEWER_LIBRARY_DIR}/Image/Utilities/MemoryBudget.cpp
   ${VIEWER_LIBRARY_DIR}/Image/ImageContainer/RawImageContainer.cpp
   ${VIEWER_LIBRARY_DIR}/Image/ImageContainer/CompressedImageContainer.cpp
   ${VIEWER_LIBRARY_DIR}/Image/ImageContainer/CornerstoneKLVContainer.cpp